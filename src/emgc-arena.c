@@ -0,0 +1,220 @@
+// emgc-arena.c implements an optional GC-owned small-object heap. Build with -DEMGC_SMALL_OBJECT_ARENA to enable it.
+// Small allocations are then not malloc()ed one by one, but carved out of 64KB arena pages that each serve a single
+// size class. Each page tracks its objects with used/mark/leaf/finalizer bitmaps, so small allocations do not occupy
+// slots in the managed allocation hash table. Testing whether a value points to an arena object is an O(1) page map
+// lookup, and sweeping a page is a handful of bitwise operations per 64 objects.
+// Allocations larger than ARENA_MAX_SIZE keep using the malloc()-backed allocation table.
+
+#ifdef EMGC_SMALL_OBJECT_ARENA
+
+#define ARENA_PAGE_SIZE 65536
+#define ARENA_GRANULE 16 // Size class step and the alignment of all arena objects.
+#define ARENA_MAX_SIZE 128 // Largest allocation size (in bytes) that is served from the arena.
+#define ARENA_NUM_CLASSES (ARENA_MAX_SIZE / ARENA_GRANULE)
+#define ARENA_BITMAP_WORDS (ARENA_PAGE_SIZE / ARENA_GRANULE / 64)
+
+typedef struct arena_page
+{
+  uint64_t used[ARENA_BITMAP_WORDS], mark[ARENA_BITMAP_WORDS], leaf[ARENA_BITMAP_WORDS], finalizer[ARENA_BITMAP_WORDS];
+  struct arena_page *next_free; // Links pages of the same size class that still have free object slots.
+  char *objects; // Address of the first object in this page.
+  uint32_t obj_size, num_objects, num_used, page_index;
+  uint8_t size_class, in_free_list;
+} arena_page;
+
+static arena_page **arena_pages; // All arena pages, in no particular order.
+static uint32_t num_arena_pages, arena_pages_cap, arena_num_allocs;
+static arena_page *arena_free_pages[ARENA_NUM_CLASSES]; // Per size class, the pages that have free slots left.
+static uint8_t arena_page_map[((uint64_t)1 << 32) / ARENA_PAGE_SIZE / 8]; // One bit per 64KB of address space: is there an arena page?
+
+static arena_page *arena_page_of(void *ptr)
+{
+  uint64_t p = (uintptr_t)ptr / ARENA_PAGE_SIZE;
+  if (p >= sizeof(arena_page_map)*8 || !BITVEC_GET(arena_page_map, p)) return 0;
+  return (arena_page*)(p * ARENA_PAGE_SIZE);
+}
+
+// Returns the object index of ptr inside the given page, or INVALID_INDEX if ptr does not point to the start of a live
+// arena object.
+static uint32_t arena_object_index(arena_page *page, void *ptr)
+{
+  uintptr_t offset = (uintptr_t)ptr - (uintptr_t)page->objects;
+  if ((uintptr_t)ptr < (uintptr_t)page->objects || offset % page->obj_size) return INVALID_INDEX;
+  uint32_t i = offset / page->obj_size;
+  return (i < page->num_objects && BITVEC_GET((uint8_t*)page->used, i)) ? i : INVALID_INDEX;
+}
+
+// Returns the object index of the live arena object that contains the address ptr, or INVALID_INDEX if there is none.
+static uint32_t arena_object_index_containing(arena_page *page, void *ptr)
+{
+  if ((uintptr_t)ptr < (uintptr_t)page->objects) return INVALID_INDEX;
+  uint32_t i = ((uintptr_t)ptr - (uintptr_t)page->objects) / page->obj_size;
+  return (i < page->num_objects && BITVEC_GET((uint8_t*)page->used, i)) ? i : INVALID_INDEX;
+}
+
+#ifdef EMGC_INTERIOR_POINTERS
+#define ARENA_MARK_INDEX(page, ptr) arena_object_index_containing((page), (ptr))
+#else
+#define ARENA_MARK_INDEX(page, ptr) arena_object_index((page), (ptr))
+#endif
+
+static arena_page *arena_new_page(uint32_t size_class)
+{
+  arena_page *page = (arena_page*)aligned_alloc(ARENA_PAGE_SIZE, ARENA_PAGE_SIZE);
+  if (!page) return 0;
+  if (num_arena_pages == arena_pages_cap)
+  {
+    arena_page **pages = (arena_page**)realloc(arena_pages, (arena_pages_cap = (arena_pages_cap*2) | 15) * sizeof(arena_page*));
+    if (!pages) { free(page); return 0; }
+    arena_pages = pages;
+  }
+  memset(page, 0, sizeof(arena_page));
+  page->size_class = size_class;
+  page->obj_size = (size_class+1) * ARENA_GRANULE;
+  page->objects = (char*)page + ((sizeof(arena_page) + ARENA_GRANULE-1) & ~(ARENA_GRANULE-1));
+  page->num_objects = ((char*)page + ARENA_PAGE_SIZE - page->objects) / page->obj_size;
+  page->page_index = num_arena_pages;
+  arena_pages[num_arena_pages++] = page;
+  BITVEC_SET(arena_page_map, (uintptr_t)page / ARENA_PAGE_SIZE);
+  heap_index_ref_pages((uintptr_t)page, (uintptr_t)page + ARENA_PAGE_SIZE, 1);
+  return page;
+}
+
+static void arena_release_page(arena_page *page)
+{
+  assert(page->num_used == 0);
+  BITVEC_CLEAR(arena_page_map, (uintptr_t)page / ARENA_PAGE_SIZE);
+  heap_index_ref_pages((uintptr_t)page, (uintptr_t)page + ARENA_PAGE_SIZE, -1);
+  arena_pages[page->page_index] = arena_pages[--num_arena_pages];
+  arena_pages[page->page_index]->page_index = page->page_index;
+  free(page);
+}
+
+static void *arena_malloc_locked(size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t size_class = bytes ? (bytes-1) / ARENA_GRANULE : 0;
+  if (!table) realloc_table(); // The rest of the collector assumes that the allocation table always exists after the first allocation.
+  arena_page *page = arena_free_pages[size_class];
+  if (!page && (page = arena_new_page(size_class)))
+  {
+    page->in_free_list = 1;
+    arena_free_pages[size_class] = page;
+  }
+  if (!page) return 0;
+
+  uint32_t w = 0;
+  while(page->used[w] == (uint64_t)-1) ++w;
+  uint32_t i = (w<<6) + __builtin_ctzll(~page->used[w]);
+  assert(i < page->num_objects);
+  page->used[w] |= 1ull << (i&63);
+  if (incremental_phase != INCREMENTAL_IDLE) page->mark[w] |= 1ull << (i&63);
+  else page->mark[w] &= ~(1ull << (i&63)); // A freed slot may have been left marked.
+  ++arena_num_allocs;
+  pacing_count_malloc(page->obj_size);
+  if (++page->num_used == page->num_objects) // Page got full, unlink it from the free list.
+  {
+    arena_free_pages[size_class] = page->next_free;
+    page->in_free_list = 0;
+  }
+
+  char *ptr = page->objects + i * page->obj_size;
+  memset(ptr + bytes, 0, page->obj_size - bytes); // Clear the size class slack so that stale pointers there won't be marked.
+  return ptr;
+}
+
+static void *arena_malloc(size_t bytes)
+{
+  GC_MALLOC_ACQUIRE();
+  void *ptr = arena_malloc_locked(bytes);
+  GC_MALLOC_RELEASE();
+  return ptr;
+}
+
+// Frees the given arena object. Caller must have already detached roots, finalizers and weak pointers of the object.
+static void arena_free(arena_page *page, uint32_t i)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  concurrent_mark_freed(page->objects + i * page->obj_size, page->obj_size, BITVEC_GET((uint8_t*)page->leaf, i));
+  BITVEC_CLEAR((uint8_t*)page->used, i);
+  BITVEC_CLEAR((uint8_t*)page->leaf, i);
+  BITVEC_CLEAR((uint8_t*)page->finalizer, i);
+  --page->num_used;
+  --arena_num_allocs;
+  pacing_count_free(page->obj_size);
+  if (!page->in_free_list)
+  {
+    page->in_free_list = 1;
+    page->next_free = arena_free_pages[page->size_class];
+    arena_free_pages[page->size_class] = page;
+  }
+}
+
+static void arena_set_flag(uint64_t *bitmap, uint32_t i, int set)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  if (set) BITVEC_SET((uint8_t*)bitmap, i);
+  else BITVEC_CLEAR((uint8_t*)bitmap, i);
+}
+
+// Sweeps all arena pages: frees unmarked objects, and clears the mark bits for the next collection.
+static void arena_sweep(int detach_weak_ptrs)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  for(uint32_t p = 0; p < num_arena_pages; ++p)
+  {
+    arena_page *page = arena_pages[p];
+    uint32_t num_freed = 0;
+#ifdef __wasm_simd128__
+    for(uint32_t w = 0; w < ARENA_BITMAP_WORDS; w += 2)
+    {
+      v128_t used = wasm_v128_load(page->used + w), mark = wasm_v128_load(page->mark + w);
+      v128_t dead = wasm_v128_andnot(used, mark);
+      if (!wasm_v128_any_true(dead)) continue;
+      uint64_t lo = wasm_u64x2_extract_lane(dead, 0), hi = wasm_u64x2_extract_lane(dead, 1);
+      num_freed += __builtin_popcountll(lo) + __builtin_popcountll(hi);
+      if (detach_weak_ptrs)
+        for(uint32_t k = 0, offset; k < 2; ++k)
+          for(uint64_t b = k ? hi : lo; b; b ^= 1ull << offset)
+            remove_weak_ptr(page->objects + ((w+k)*64 + (offset = __builtin_ctzll(b))) * page->obj_size);
+      wasm_v128_store(page->used + w, wasm_v128_and(used, mark));
+      wasm_v128_store(page->leaf + w, wasm_v128_and(wasm_v128_load(page->leaf + w), mark));
+      wasm_v128_store(page->finalizer + w, wasm_v128_and(wasm_v128_load(page->finalizer + w), mark));
+    }
+#else
+    for(uint32_t w = 0, offset; w < ARENA_BITMAP_WORDS; ++w)
+    {
+      uint64_t dead = page->used[w] & ~page->mark[w];
+      if (!dead) continue;
+      num_freed += __builtin_popcountll(dead);
+      if (detach_weak_ptrs)
+        for(uint64_t b = dead; b; b ^= 1ull << offset)
+          remove_weak_ptr(page->objects + (w*64 + (offset = __builtin_ctzll(b))) * page->obj_size);
+      page->used[w] &= page->mark[w];
+      page->leaf[w] &= page->mark[w];
+      page->finalizer[w] &= page->mark[w];
+    }
+#endif
+    page->num_used -= num_freed;
+    arena_num_allocs -= num_freed;
+    pacing_count_free((size_t)num_freed * page->obj_size);
+#ifndef EMGC_GENERATIONAL // In generational mode, the mark bits stick to tell the old generation apart.
+    memset(page->mark, 0, sizeof(page->mark));
+#endif
+  }
+
+  // Rebuild the free lists, and give completely empty pages back to the system allocator.
+  for(uint32_t c = 0; c < ARENA_NUM_CLASSES; ++c) arena_free_pages[c] = 0;
+  for(uint32_t p = 0; p < num_arena_pages; ++p)
+  {
+    arena_page *page = arena_pages[p];
+    if (!page->num_used) { arena_release_page(page); --p; continue; }
+    if ((page->in_free_list = (page->num_used < page->num_objects)))
+    {
+      page->next_free = arena_free_pages[page->size_class];
+      arena_free_pages[page->size_class] = page;
+    }
+  }
+}
+
+#endif
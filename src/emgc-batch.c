@@ -0,0 +1,139 @@
+// emgc-batch.c implements batched variants of the allocation, root and free functions.
+// They acquire the GC lock (and the roots lock) only once for a whole array of pointers, which
+// helps programs that create or discard large numbers of managed objects in bursts.
+
+size_t gc_malloc_batch(size_t bytes, size_t num, uint32_t flags, gc_finalizer finalizer, void **ptrs)
+{
+  ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  gc_pace();
+  size_t n = 0;
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  int use_arena = (bytes <= ARENA_MAX_SIZE);
+#else
+  int use_arena = 0;
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  int use_los = (bytes >= EMGC_LARGE_OBJECT_THRESHOLD);
+#else
+  int use_los = 0;
+#endif
+  // Call into the system allocator outside the GC lock.
+  if (!use_arena && !use_los)
+    for(; n < num && (ptrs[n] = (flags & GC_FLAG_ZERO) ? calloc(bytes, 1) : malloc(bytes)); ++n) ; // nop
+
+  GC_MALLOC_ACQUIRE();
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  if (use_los)
+    for(; n < num && (ptrs[n] = los_malloc_locked(bytes)); ++n)
+    {
+      los_span *span = los_span_of(ptrs[n]);
+      span->leaf = !!(flags & GC_FLAG_LEAF);
+      span->finalizer = (finalizer != 0);
+    }
+  else
+#endif
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  if (use_arena)
+    for(; n < num && (ptrs[n] = arena_malloc_locked(bytes)); ++n)
+    {
+      arena_page *page = arena_page_of(ptrs[n]);
+      uint32_t i = arena_object_index(page, ptrs[n]);
+      if ((flags & GC_FLAG_LEAF)) arena_set_flag(page->leaf, i, 1);
+      if (finalizer) arena_set_flag(page->finalizer, i, 1);
+    }
+  else
+#endif
+  {
+    uintptr_t ptr_bits = ((flags & GC_FLAG_LEAF) ? PTR_LEAF_BIT : 0) | (finalizer ? PTR_FINALIZER_BIT : 0);
+    for(size_t i = 0; i < n; ++i)
+      record_gc_malloc((void*)((uintptr_t)ptrs[i] | ptr_bits), bytes); // Record the allocation along with its flags in one table insertion.
+  }
+
+  if (finalizer)
+    for(size_t i = 0; i < n; ++i)
+    {
+      reserve_finalizer();
+      insert_finalizer(ptrs[i], finalizer);
+    }
+
+  if ((flags & GC_FLAG_ROOT) && n)
+  {
+    gc_acquire_lock(&roots_lock);
+    for(size_t i = 0; i < n; ++i)
+    {
+      reserve_root();
+      insert_root(ptrs[i]);
+    }
+    gc_release_lock(&roots_lock);
+  }
+  GC_MALLOC_RELEASE();
+
+  if ((use_arena || use_los) && (flags & GC_FLAG_ZERO))
+    for(size_t i = 0; i < n; ++i) memset(ptrs[i], 0, bytes);
+  return n;
+}
+
+void gc_free_batch(void **ptrs, size_t num)
+{
+  ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  if (roots)
+  {
+    gc_acquire_lock(&roots_lock);
+    for(size_t i = 0; i < num; ++i)
+      if (ptrs[i]) remove_root(ptrs[i]);
+    gc_release_lock(&roots_lock);
+  }
+  for(size_t i = 0; i < num; ++i)
+  {
+    void *ptr = ptrs[i];
+    if (!ptr) continue;
+    if (num_finalizers || num_ready_finalizers) remove_finalizer(ptr);
+#ifdef EMGC_SMALL_OBJECT_ARENA
+    arena_page *page = arena_page_of(ptr);
+    if (page)
+    {
+      uint32_t j = arena_object_index(page, ptr);
+      assert(j != INVALID_INDEX && "gc_free_batch() called on a pointer that is not a live GC allocation, or the same pointer was passed twice.");
+      remove_weak_ptr(ptr);
+      arena_free(page, j);
+      continue;
+    }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+    los_span *span = los_span_of(ptr);
+    if (span)
+    {
+      remove_weak_ptr(ptr);
+      los_free(span);
+      continue;
+    }
+#endif
+    uint32_t j = table_find(ptr);
+    assert(j != INVALID_INDEX && "gc_free_batch() called on a pointer that is not a live GC allocation, or the same pointer was passed twice.");
+    table_free(j);
+  }
+  GC_MALLOC_RELEASE();
+}
+
+void gc_make_roots(void **ptrs, size_t num)
+{
+  for(size_t i = 0; i < num; ++i) assert(ptrs[i] && gc_is_ptr(ptrs[i]));
+  gc_acquire_lock(&roots_lock);
+  for(size_t i = 0; i < num; ++i)
+  {
+    reserve_root();
+    insert_root(ptrs[i]);
+  }
+  gc_release_lock(&roots_lock);
+}
+
+void gc_unmake_roots(void **ptrs, size_t num)
+{
+  if (!roots) return;
+  for(size_t i = 0; i < num; ++i) assert(ptrs[i] && gc_is_ptr(ptrs[i]));
+  gc_acquire_lock(&roots_lock);
+  for(size_t i = 0; i < num; ++i) remove_root(ptrs[i]);
+  gc_release_lock(&roots_lock);
+}
@@ -0,0 +1,169 @@
+// emgc-concurrent.c implements the opt-in concurrent marking mode (-DEMGC_CONCURRENT_MARKING) of multithreaded builds.
+// A collection starts with a short initial pause, in which the participating threads only mark the allocations that
+// their stacks, the globals and the roots point to (the latter shared between them, see emgc-parallel_roots.c). These
+// are pushed to the mark deques without tracing them. Then the mutators resume, and the sweep worker traces the rest of
+// the heap by stealing from the deques, taking the GC lock for each few objects that it scans. Finally the sweep worker stops the
+// mutators for a short final pause, in which they help to finish marking, after which the sweep worker sweeps.
+// Marking follows the "snapshot at the beginning" (SATB) principle: everything that was reachable at the initial pause
+// is marked, and allocations made after it are created marked. For this, the program must report each managed pointer
+// that it overwrites in a managed allocation during marking with the pre-write barrier gc_pre_write_barrier() (or do
+// the store with gc_store_ptr()). The barrier logs the overwritten pointer to a thread-local SATB buffer, which is
+// marked when the buffer gets full, when the thread leaves the fence, or in the final pause. Stores to stacks, globals
+// and custom root blocks need no barrier, since they were scanned in the initial pause.
+// If the sweep worker has not started up yet, collections are performed with the regular stop-the-world marking.
+
+#ifdef EMGC_CONCURRENT_MARKING
+
+#ifndef EMGC_SATB_BUFFER_SIZE
+#define EMGC_SATB_BUFFER_SIZE 256 // Number of overwritten pointers that each thread can log before marking them.
+#endif
+#define CONCURRENT_MARK_BATCH 16 // Number of queued objects that the sweep worker scans per GC lock acquisition.
+
+#define CONCURRENT_IDLE 0
+#define CONCURRENT_INITIAL_PAUSE 1
+#define CONCURRENT_TRACING 2
+#define CONCURRENT_FINAL_PAUSE 3
+static _Atomic(int) concurrent_phase;
+
+static __thread void *satb_buffer[EMGC_SATB_BUFFER_SIZE];
+static __thread uint32_t satb_count;
+
+// Marks the pointers in this thread's SATB buffer. Called with the GC lock held, or in the final pause.
+static void satb_mark()
+{
+  for(uint32_t i = 0; i < satb_count; ++i) mark_maybe_ptr(satb_buffer[i]);
+  satb_count = 0;
+}
+
+static void satb_flush()
+{
+  if (!satb_count) return;
+  if (incremental_phase != INCREMENTAL_MARKING) // The buffer is left over from marking that has finished.
+  {
+    satb_count = 0;
+    return;
+  }
+  GC_MALLOC_ACQUIRE();
+  satb_mark();
+  GC_MALLOC_RELEASE();
+}
+
+static void satb_log(void *ptr)
+{
+  if (!mark_looks_like_ptr((uintptr_t)ptr)) return;
+  satb_buffer[satb_count++] = ptr;
+  if (satb_count == EMGC_SATB_BUFFER_SIZE) satb_flush();
+}
+
+// Called with the GC lock held at the start of a collection. Chooses concurrent marking if the sweep worker is there
+// to do the tracing.
+static void concurrent_begin_locked()
+{
+  if (!sweep_worker_running) return;
+  concurrent_phase = CONCURRENT_INITIAL_PAUSE;
+  incremental_phase = INCREMENTAL_MARKING; // Allocate marked from now on.
+}
+
+// The part of a collection that a participating thread performs in a pause. Returns 0 if marking is not concurrent.
+static int concurrent_participate()
+{
+  if (concurrent_phase == CONCURRENT_INITIAL_PAUSE)
+  {
+    mark_current_thread_stack(); // Pushes the allocations that the stack points to to this thread's deque, but doesn't trace them.
+    while(mark_root_chunk()) ; // Likewise for the roots, which must all be scanned within the pause.
+    wait_for_all_threads_finished_marking();
+    return 1;
+  }
+  if (concurrent_phase == CONCURRENT_FINAL_PAUSE)
+  {
+    satb_mark();
+    mark_from_queue();
+    return 1;
+  }
+  return 0;
+}
+
+// Ends the initial pause on the collecting thread, and hands the tracing over to the sweep worker. Returns 0 if marking
+// is not concurrent.
+static int concurrent_finish_initial_pause()
+{
+  if (concurrent_phase != CONCURRENT_INITIAL_PAUSE) return 0;
+  while(mark_root_chunk()) ;
+  wait_for_all_threads_finished_marking();
+  concurrent_phase = CONCURRENT_TRACING;
+  mt_marking_running = 0;
+  gc_exit_fence();
+  GC_MALLOC_RELEASE();
+  emscripten_semaphore_release(&sweep_command, 1);
+  return 1;
+}
+
+// Scans up to CONCURRENT_MARK_BATCH objects from the mark deques. Called on the sweep worker with the GC lock held, while
+// mutators are running. Returns 0 if the deques were empty.
+static int concurrent_mark_batch()
+{
+  mark_item item;
+  for(int i = 0; i < CONCURRENT_MARK_BATCH; ++i)
+  {
+    if (!mark_next(&item)) return 0;
+    scan_item(item);
+  }
+  return 1;
+}
+
+// Runs on the sweep worker: traces the heap while mutators run, then finishes marking in a final pause, and sweeps.
+// Returns 0 if marking is not concurrent, and the worker should only sweep.
+static int concurrent_trace()
+{
+  if (concurrent_phase != CONCURRENT_TRACING) return 0;
+  for(int more = 1; more;)
+  {
+    GC_MALLOC_ACQUIRE();
+    more = concurrent_mark_batch();
+    GC_MALLOC_RELEASE();
+  }
+
+  // Stop the mutators like start_multithreaded_collection() does, counting this worker in as a participant.
+  gc_wait_for_all_threads_resumed_execution();
+  ++num_threads_accessing_managed_state;
+  num_threads_resumed_execution = num_threads_finished_marking = 0;
+  num_threads_ready_to_start_marking = 0;
+  concurrent_phase = CONCURRENT_FINAL_PAUSE;
+  mt_marking_running = 1;
+  while(num_threads_ready_to_start_marking + 1 < num_threads_accessing_managed_state) gc_uninterrupted_sleep(1);
+  GC_MALLOC_ACQUIRE();
+  table_finish_migration(); // Mutators may have started a table resize while this worker traced, see begin_collection_locked().
+  ++num_threads_ready_to_start_marking;
+  wait_for_all_participants();
+  num_threads_ready_to_start_marking |= MARKING_CLOSED_BIT;
+  mark_from_queue(); // The participants mark their SATB buffers, and together finish marking.
+
+  incremental_phase = INCREMENTAL_IDLE;
+  concurrent_phase = CONCURRENT_IDLE;
+  mt_marking_running = 0;
+  --num_threads_accessing_managed_state;
+  sweep(); // Releases the GC lock.
+  return 1;
+}
+
+// Waits for the concurrent marking of a previous collection to finish, participating to its final pause.
+static void wait_for_concurrent_marking()
+{
+  while(concurrent_phase != CONCURRENT_IDLE)
+  {
+    gc_participate_to_garbage_collection();
+    gc_uninterrupted_sleep(1);
+  }
+  satb_flush();
+}
+
+// Called with the GC lock held before a mutator frees an allocation: the program may still hold pointers that it read
+// from the allocation, which marking would then not find in the snapshot.
+static void concurrent_mark_freed(void *ptr, size_t bytes, int leaf)
+{
+  if (incremental_phase == INCREMENTAL_MARKING && !leaf) mark(ptr, bytes);
+}
+
+#else
+static void concurrent_mark_freed(void *ptr, size_t bytes, int leaf) {}
+#endif
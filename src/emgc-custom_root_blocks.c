@@ -13,9 +13,11 @@ static uint32_t hash_custom_root(void *ptr) { return (uint32_t)((uintptr_t)ptr >
 
 static void mark_custom_root_blocks()
 {
-  if (custom_roots)
-    for(uint32_t i = 0; i <= custom_roots_mask; ++i)
-      mark(custom_roots[i].start, (uintptr_t)custom_roots[i].end - (uintptr_t)custom_roots[i].start);
+  if (!custom_roots) return;
+  gc_acquire_lock(&custom_roots_lock); // Removing a block may shrink the table, so hold the lock while scanning.
+  for(uint32_t i = 0; i <= custom_roots_mask; ++i)
+    mark(custom_roots[i].start, (uintptr_t)custom_roots[i].end - (uintptr_t)custom_roots[i].start);
+  gc_release_lock(&custom_roots_lock);
 }
 
 static void insert_custom_root(void *start __attribute__((nonnull)), void *end __attribute__((nonnull)))
@@ -24,43 +26,60 @@ static void insert_custom_root(void *start __attribute__((nonnull)), void *end _
   assert(end);
   assert(start <= end);
 
-#if !defined(NDEBUG) && !EMGC_SKIP_AUTOMATIC_STATIC_MARKING
+#if !defined(NDEBUG) && !EMGC_SKIP_AUTOMATIC_STATIC_MARKING && !defined(EMGC_SCAN_MANAGED_GLOBALS_ONLY)
   // When building without -DEMGC_SKIP_AUTOMATIC_STATIC_MARKING, custom added root blocks cannot be contained within global/static data section. (they are already covered automatically)
   assert(((uintptr_t)start >= (uintptr_t)&__data_end || (uintptr_t)end <= (uintptr_t)&__global_base) && "When building without -DEMGC_SKIP_AUTOMATIC_STATIC_MARKING, custom root blocks cannot be memory areas that are contained in the program global/static data section, because that section is already explicitly tracked. Build with -DEMGC_SKIP_AUTOMATIC_STATIC_MARKING to skip automatic global/static marking.");
 #endif
 
   uint32_t i = hash_custom_root(start);
-  while((uintptr_t)custom_roots[i].start > 1)
+  while(custom_roots[i].start)
   {
     assert(custom_roots[i].start != start && "gc_add_custom_root_block() attempted to register the same custom root block twice!");
     i = (i+1) & custom_roots_mask;
   }
-  if ((uintptr_t)custom_roots[i].start == 0) ++num_custom_roots_slots_populated;
+  ++num_custom_roots_slots_populated;
   custom_roots[i].start = start;
   custom_roots[i].end = end;
 }
 
-void gc_add_custom_root_block(void *ptr __attribute__((nonnull)), size_t bytes)
+// Rehashes the custom root blocks table to the given size. Caller must hold custom_roots_lock.
+static void resize_custom_roots(uint32_t new_mask)
 {
-  assert(ptr);
-  assert(gc_ptr_base(ptr) == 0); // This root block cannot be contained within managed memory area.
-  gc_acquire_lock(&custom_roots_lock);
   uint32_t old_mask = custom_roots_mask;
-  if (2*num_custom_roots_slots_populated >= custom_roots_mask)
+  span *old_roots = custom_roots;
+  custom_roots_mask = new_mask;
+  custom_roots = (span*)calloc(custom_roots_mask+1, sizeof(span));
+  assert(custom_roots);
+  num_custom_roots_slots_populated = 0;
+  if (old_roots)
   {
-    custom_roots_mask = (custom_roots_mask << 1) | 1;
+    for(uint32_t i = 0; i <= old_mask; ++i)
+      if (old_roots[i].start) insert_custom_root(old_roots[i].start, old_roots[i].end);
+    free(old_roots);
+  }
+}
 
-    span *old_roots = custom_roots;
-    custom_roots = (span*)calloc(custom_roots_mask+1, sizeof(span));
-    assert(custom_roots);
-    num_custom_roots_slots_populated = 0;
-    if (old_roots)
+// Removes the custom root block in slot i with backward shift deletion, and shrinks the table if it has become overly
+// sparse. Caller must hold custom_roots_lock.
+static void erase_custom_root(uint32_t i)
+{
+  for(uint32_t j = (i+1) & custom_roots_mask; custom_roots[j].start; j = (j+1) & custom_roots_mask)
+    if (((j - hash_custom_root(custom_roots[j].start)) & custom_roots_mask) >= ((j - i) & custom_roots_mask))
     {
-      for(uint32_t i = 0; i <= old_mask; ++i)
-        if ((uintptr_t)old_roots[i].start > 1) insert_custom_root(old_roots[i].start, old_roots[i].end);
-      free(old_roots);
+      custom_roots[i] = custom_roots[j];
+      i = j;
     }
-  }
+  custom_roots[i].start = custom_roots[i].end = 0;
+  --num_custom_roots_slots_populated;
+  if (8*num_custom_roots_slots_populated < custom_roots_mask && custom_roots_mask > AUX_TABLE_MIN_MASK) resize_custom_roots(custom_roots_mask >> 1);
+}
+
+void gc_add_custom_root_block(void *ptr __attribute__((nonnull)), size_t bytes)
+{
+  assert(ptr);
+  assert(gc_ptr_base(ptr) == 0); // This root block cannot be contained within managed memory area.
+  gc_acquire_lock(&custom_roots_lock);
+  if (2*num_custom_roots_slots_populated >= custom_roots_mask) resize_custom_roots((custom_roots_mask << 1) | 1);
   insert_custom_root(ptr, ptr + bytes);
   gc_release_lock(&custom_roots_lock);
 }
@@ -74,7 +93,7 @@ void gc_remove_custom_root_block(void *ptr __attribute__((nonnull)))
   for(uint32_t i = hash_custom_root(ptr); custom_roots[i].start; i = (i+1) & custom_roots_mask)
     if (custom_roots[i].start == ptr)
     {
-      custom_roots[i].start = custom_roots[i].end = (void*)1;
+      erase_custom_root(i);
       found_custom_root_block = true;
       break;
     }
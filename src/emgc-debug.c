@@ -1,12 +1,46 @@
 uint32_t gc_num_ptrs()
 {
-  return num_allocs;
+  uint32_t num_ptrs = num_allocs;
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+  num_ptrs += tlab_count; // Allocations buffered in other threads' TLABs are not counted.
+#endif
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  num_ptrs += arena_num_allocs;
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  num_ptrs += los_num_allocs;
+#endif
+  return num_ptrs;
 }
 
 void gc_dump()
 {
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  table_finish_migration();
+  GC_MALLOC_RELEASE();
   if (table)
     for(uint32_t i = 0; i <= table_mask; ++i)
-      if (table[i] > SENTINEL_PTR) EM_ASM({console.log(`Table index ${$0}: 0x${$1.toString(16)}`);}, i, table[i]);
+      if (TABLE_PTR(i)) EM_ASM({console.log(`Table index ${$0}: 0x${$1.toString(16)}`);}, i, TABLE_PTR(i));
   EM_ASM({console.log(`${$0} allocations total, ${$1} used table entries. Table size: ${$2}`);}, num_allocs, num_table_entries, table_mask+1);
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  for(uint32_t p = 0; p < num_arena_pages; ++p)
+    EM_ASM({console.log(`Arena page 0x${$0.toString(16)}: ${$1}/${$2} objects of ${$3} bytes`);}, arena_pages[p], arena_pages[p]->num_used, arena_pages[p]->num_objects, arena_pages[p]->obj_size);
+  EM_ASM({console.log(`${$0} arena allocations total in ${$1} pages.`);}, arena_num_allocs, num_arena_pages);
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  for(uint32_t i = 0; i < los_spans.num; ++i)
+    EM_ASM({console.log(`Large object 0x${$0.toString(16)}: ${$1} bytes in ${$2} pages`);}, los_spans.spans[i]->start, los_spans.spans[i]->bytes, los_spans.spans[i]->num_pages);
+  EM_ASM({console.log(`${$0} large objects total.`);}, los_num_allocs);
+#endif
+}
+
+uint32_t debug_gc_table_size()
+{
+  return table_mask+1;
+}
+
+void debug_gc_set_batched_mark_lookups(int enabled)
+{
+  mark_batched_lookups = enabled;
 }
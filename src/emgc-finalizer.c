@@ -5,7 +5,12 @@ typedef struct finalizer_map
 } finalizer_map;
 
 static finalizer_map *finalizers;
-static uint32_t num_finalizers, num_finalizer_slots_populated, finalizers_mask, num_finalizers_marked;
+static uint32_t num_finalizers, finalizers_mask, num_finalizers_marked;
+
+// Finalizers of unreachable allocations, waiting to be run. The queue is scanned as a root, so that the allocations
+// stay alive until their finalizers have been run. Allocated from the system allocator.
+static finalizer_map *ready_finalizers;
+static uint32_t num_ready_finalizers, ready_finalizers_cap;
 
 static uint32_t hash_finalizer(void *ptr) { return (uint32_t)((uintptr_t)ptr >> 3) & finalizers_mask; }
 
@@ -17,41 +22,186 @@ static uint32_t find_finalizer_index(void *ptr)
   return INVALID_INDEX;
 }
 
-static void find_and_run_a_finalizer()
+static void resize_finalizers(uint32_t new_mask);
+
+// Removes the finalizer in slot i with backward shift deletion, and shrinks the table if it has become overly sparse.
+static void erase_finalizer(uint32_t i)
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
+  for(uint32_t j = (i+1) & finalizers_mask; finalizers[j].ptr; j = (j+1) & finalizers_mask)
+    if (((j - hash_finalizer(finalizers[j].ptr)) & finalizers_mask) >= ((j - i) & finalizers_mask))
+    {
+      finalizers[i] = finalizers[j];
+      i = j;
+    }
+  finalizers[i].ptr = 0;
+  finalizers[i].finalizer = 0;
+  --num_finalizers;
+  if (8*num_finalizers < finalizers_mask && finalizers_mask > AUX_TABLE_MIN_MASK) resize_finalizers(finalizers_mask >> 1);
+}
+
+// Moves the finalizer of the given unreachable allocation to the ready queue. Caller must have cleared the finalizer
+// bit of the allocation.
+static void queue_finalizer(void *ptr)
+{
+  uint32_t f = find_finalizer_index(ptr);
+  assert(f != INVALID_INDEX);
+  if (num_ready_finalizers == ready_finalizers_cap)
+  {
+    ready_finalizers_cap = (ready_finalizers_cap*2) | 31;
+    ready_finalizers = (finalizer_map*)realloc(ready_finalizers, ready_finalizers_cap*sizeof(finalizer_map));
+    assert(ready_finalizers);
+  }
+  ready_finalizers[num_ready_finalizers++] = finalizers[f];
+  erase_finalizer(f);
+}
+
+// Marks everything that the contents of the given unreachable finalizable allocation point to. The allocation is
+// flagged marked while it is scanned, so that pointers from it back to itself, directly or through a cycle, do not
+// mark it, and the flag is cleared afterwards, so that only pointers from other finalizable allocations leave it marked.
+#define MARK_FROM_FINALIZABLE(set_mark, clear_mark, ptr, bytes, type) do { \
+    set_mark; \
+    scan_object((ptr), (bytes), (type)); \
+    mark_drain(); \
+    clear_mark; \
+  } while(0)
+
+// Visits the unmarked allocations that have finalizers. If queue is 0, marks from the contents of each (see
+// MARK_FROM_FINALIZABLE), so that the finalizable allocations that another one points to get marked. Otherwise moves
+// the finalizer of each to the ready queue.
+static void visit_unreachable_finalizers(int queue)
+{
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  for(uint32_t p = 0; p < num_arena_pages; ++p)
+  {
+    arena_page *page = arena_pages[p];
+    for(uint32_t w = 0, offset; w < ARENA_BITMAP_WORDS; ++w)
+      for(uint64_t b = page->used[w] & ~page->mark[w] & page->finalizer[w]; b; b ^= 1ull << offset)
+      {
+        uint32_t i = w*64 + (offset = __builtin_ctzll(b));
+        if (queue)
+        {
+          BITVEC_CLEAR((uint8_t*)page->finalizer, i);
+          queue_finalizer(page->objects + i * page->obj_size);
+        }
+        else if (!BITVEC_GET((uint8_t*)page->mark, i) && !BITVEC_GET((uint8_t*)page->leaf, i)) // Not marked from an earlier one.
+          MARK_FROM_FINALIZABLE(BITVEC_SET((uint8_t*)page->mark, i), BITVEC_CLEAR((uint8_t*)page->mark, i), page->objects + i * page->obj_size, page->obj_size, 0);
+      }
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  for(uint32_t i = 0; i < los_spans.num; ++i)
+  {
+    los_span *span = los_spans.spans[i];
+    if (!span->mark && span->finalizer)
+    {
+      if (queue)
+      {
+        span->finalizer = 0;
+        queue_finalizer(span->start);
+      }
+      else if (!span->leaf) MARK_FROM_FINALIZABLE(span->mark = 1, span->mark = 0, span->start, span->bytes, 0);
+    }
+  }
+#endif
 
-  for(uint32_t i = 0, offset; i <= table_mask; i += 64)
-    for(uint64_t b = ((uint64_t*)used_table)[i>>6] & ~((uint64_t*)mark_table)[i>>6]; b; b ^= (1ull<<offset))
+  for(uint32_t g = 0; g <= table_mask / TABLE_GROUP_SIZE; ++g)
+    for(uint32_t b = table[g].used & ~(uint32_t)table[g].mark, offset; b; b ^= 1u << offset)
     {
-      uint32_t j = i + (offset = __builtin_ctzll(b));
-      if (HAS_FINALIZER_BIT(table[j]))
+      uint32_t j = g*TABLE_GROUP_SIZE + (offset = __builtin_ctz(b));
+      if (!HAS_FINALIZER_BIT(TABLE_PTR(j))) continue;
+      if (queue)
       {
-        table[j] = (void*)((uintptr_t)table[j] ^ PTR_FINALIZER_BIT);
-        uint32_t f = find_finalizer_index(REMOVE_FLAG_BITS(table[j]));
-        assert(f != INVALID_INDEX);
-        void *ptr = finalizers[f].ptr;
-        finalizers[f].ptr = (void*)1;
-        gc_finalizer finalizer_to_run = finalizers[f].finalizer;
-        --num_finalizers;
-        // Call the finalizer without GC lock present, so that the finalizer
-        // function can perform GC allocations if necessary.
-        GC_MALLOC_RELEASE();
-        finalizer_to_run(ptr);
-        GC_MALLOC_ACQUIRE();
-        return; // In this sweep, we are not going to do anything else.
+        TABLE_PTR(j) = (void*)((uintptr_t)TABLE_PTR(j) ^ PTR_FINALIZER_BIT);
+        queue_finalizer(REMOVE_FLAG_BITS(TABLE_PTR(j)));
       }
+      else if (!TABLE_IS_MARKED(j) && !HAS_LEAF_BIT(TABLE_PTR(j))) // Not marked from an earlier one.
+        MARK_FROM_FINALIZABLE(TABLE_SET_MARK(j), table[g].mark &= (uint16_t)~(1u << offset), REMOVE_FLAG_BITS(TABLE_PTR(j)), TABLE_SIZE(j), table_type(j));
     }
 }
 
+// Queues the finalizers of the unreachable allocations in topological order, like the Boehm GC does: everything that
+// the unmarked finalizable allocations point to is marked first, and only the finalizers of the allocations that are
+// still unmarked after that are queued. So if A points to B, the finalizer of A runs first, and B is finalized by a
+// later collection, once A is gone. Pointers from an allocation back to itself are ignored, like with
+// GC_register_finalizer_ignore_self() of the Boehm GC, so self-referencing allocations and cycles of finalizable
+// allocations are finalized too. The queued allocations, and everything that they point to, are then marked, so that
+// they stay alive until their finalizers have run. The rest of the garbage can then be swept right away.
+// Called after marking has completed, with the GC lock held.
+static void queue_unreachable_finalizers()
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t first = num_ready_finalizers;
+
+  visit_unreachable_finalizers(0);
+  visit_unreachable_finalizers(1);
+
+  if (num_ready_finalizers == first) return;
+  mark((void*)(ready_finalizers + first), (num_ready_finalizers - first)*sizeof(finalizer_map));
+  mark_drain();
+}
+
+// Marks the allocations whose finalizers are waiting in the ready queue.
+static void mark_ready_finalizers()
+{
+  if (num_ready_finalizers) mark((void*)ready_finalizers, num_ready_finalizers*sizeof(finalizer_map));
+}
+
+// Returns the index of the given allocation in the ready queue, or INVALID_INDEX if its finalizer is not queued.
+static uint32_t find_ready_finalizer_index(void *ptr)
+{
+  for(uint32_t i = num_ready_finalizers; i-- > 0;)
+    if (ready_finalizers[i].ptr == ptr) return i;
+  return INVALID_INDEX;
+}
+
+// Runs up to max_count finalizers from the ready queue. Each finalizer is called without the GC lock held, so that it
+// can perform GC allocations if necessary.
+static size_t run_ready_finalizers(size_t max_count)
+{
+  size_t n = 0;
+  for(; n < max_count; ++n)
+  {
+    GC_MALLOC_ACQUIRE();
+    if (!num_ready_finalizers)
+    {
+      GC_MALLOC_RELEASE();
+      break;
+    }
+    finalizer_map f = ready_finalizers[--num_ready_finalizers];
+    if (!num_ready_finalizers) // Give the queue back to the system allocator once it has drained.
+    {
+      free(ready_finalizers);
+      ready_finalizers = 0;
+      ready_finalizers_cap = 0;
+    }
+    GC_MALLOC_RELEASE();
+    f.finalizer(f.ptr);
+  }
+  return n;
+}
+
+// Runs the finalizers that a collection has queued, unless the program runs them itself with gc_run_finalizers().
+static void run_finalizers_after_collection()
+{
+#ifndef EMGC_FINALIZE_ON_DEMAND
+  run_ready_finalizers(SIZE_MAX);
+#endif
+}
+
+size_t gc_run_finalizers(size_t max_count)
+{
+  ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  return run_ready_finalizers(max_count);
+}
+
 static void insert_finalizer(void *ptr, gc_finalizer finalizer)
 {
   assert(ptr);
   uint32_t i = hash_finalizer(ptr);
-  while((uintptr_t)finalizers[i].ptr > 1 && finalizers[i].ptr != ptr)
+  while(finalizers[i].ptr && finalizers[i].ptr != ptr)
     i = (i+1) & finalizers_mask;
 
-  if (finalizers[i].ptr == 0) ++num_finalizer_slots_populated;
   if (finalizers[i].ptr != ptr)
   {
     ++num_finalizers;
@@ -60,37 +210,64 @@ static void insert_finalizer(void *ptr, gc_finalizer finalizer)
   finalizers[i].finalizer = finalizer;
 }
 
-void gc_register_finalizer(void *ptr, gc_finalizer finalizer)
+// Rehashes the finalizers table to the given size.
+static void resize_finalizers(uint32_t new_mask)
 {
-  assert(ptr);
-  assert(gc_is_strong_ptr(ptr));
-  GC_MALLOC_ACQUIRE();
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
   uint32_t old_mask = finalizers_mask;
-  if (2*num_finalizer_slots_populated >= finalizers_mask)
+  finalizer_map *old_finalizers = finalizers;
+  finalizers_mask = new_mask;
+  finalizers = (finalizer_map*)calloc(finalizers_mask+1, sizeof(finalizer_map));
+  assert(finalizers);
+  int prev_num_finalizers = num_finalizers;
+  num_finalizers = 0; // insert_finalizer() will recalculate number of registered finalizers.
+
+  if (old_finalizers)
   {
-    finalizers_mask = (finalizers_mask << 1) | 1;
+    for(uint32_t i = 0; i <= old_mask; ++i)
+      if (old_finalizers[i].ptr)
+        insert_finalizer(old_finalizers[i].ptr, old_finalizers[i].finalizer);
+    free(old_finalizers);
+  }
+  assert(prev_num_finalizers == num_finalizers); // Count should match.
+}
 
-    finalizer_map *old_finalizers = finalizers;
-    finalizers = (finalizer_map*)calloc(finalizers_mask+1, sizeof(finalizer_map));
-    assert(finalizers);
-    num_finalizer_slots_populated = 0;
-    int prev_num_finalizers = num_finalizers;
-    num_finalizers = 0; // insert_finalizer() will recalculate number of registered finalizers.
+// Grows the finalizers table if needed, so that one more finalizer can be inserted.
+static void reserve_finalizer()
+{
+  if (2*num_finalizers >= finalizers_mask) resize_finalizers((finalizers_mask << 1) | 1);
+}
 
-    if (old_finalizers)
-    {
-      for(uint32_t i = 0; i <= old_mask; ++i)
-        if ((uintptr_t)old_finalizers[i].ptr > 1)
-          insert_finalizer(old_finalizers[i].ptr, old_finalizers[i].finalizer);
-      free(old_finalizers);
-    }
-    assert(prev_num_finalizers == num_finalizers); // Count should match.
-  }
+void gc_register_finalizer(void *ptr, gc_finalizer finalizer)
+{
+  assert(ptr);
+  assert(gc_is_strong_ptr(ptr));
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  reserve_finalizer();
   insert_finalizer(ptr, finalizer);
 
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    arena_set_flag(page->finalizer, arena_object_index(page, ptr), 1);
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_of(ptr);
+  if (span)
+  {
+    span->finalizer = 1;
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
   uint32_t i = table_find(ptr);
   assert(i != INVALID_INDEX);
-  table[i] = (void*)((uintptr_t)table[i] | PTR_FINALIZER_BIT);
+  TABLE_PTR(i) = (void*)((uintptr_t)TABLE_PTR(i) | PTR_FINALIZER_BIT);
   GC_MALLOC_RELEASE();
 }
 
@@ -115,21 +292,54 @@ static void remove_finalizer(void *ptr)
   // have been just freed by the caller. Caller is responsible
   // for updating the managed allocation table PTR_FINALIZER_BIT.
   uint32_t i = find_finalizer_index(ptr);
-  if (i != INVALID_INDEX && (uintptr_t)finalizers[i].ptr > 1)
+  if (i != INVALID_INDEX) erase_finalizer(i);
+  if (num_ready_finalizers && (i = find_ready_finalizer_index(ptr)) != INVALID_INDEX) // Cancel a queued finalizer.
+    ready_finalizers[i] = ready_finalizers[--num_ready_finalizers];
+}
+
+// Moves the finalizer registration (if any) of ptr over to new_ptr. Caller is responsible for the PTR_FINALIZER_BIT of new_ptr.
+static void move_finalizer(void *ptr, void *new_ptr)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t i = find_finalizer_index(ptr);
+  if (i == INVALID_INDEX)
   {
-    finalizers[i].ptr = (void*)1;
-    --num_finalizers;
+    if (num_ready_finalizers && (i = find_ready_finalizer_index(ptr)) != INVALID_INDEX) ready_finalizers[i].ptr = new_ptr;
+    return;
   }
+  gc_finalizer finalizer = finalizers[i].finalizer;
+  remove_finalizer(ptr);
+  reserve_finalizer();
+  insert_finalizer(new_ptr, finalizer);
 }
 
 void gc_remove_finalizer(void *ptr __attribute__((nonnull)))
 {
   assert(ptr);
   assert(gc_is_strong_ptr(ptr));
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
   remove_finalizer(ptr);
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    arena_set_flag(page->finalizer, arena_object_index(page, ptr), 0);
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_of(ptr);
+  if (span)
+  {
+    span->finalizer = 0;
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
   uint32_t i = table_find(ptr);
   assert(i != INVALID_INDEX);
-  table[i] = (void*)((uintptr_t)table[i] & ~PTR_FINALIZER_BIT);
+  TABLE_PTR(i) = (void*)((uintptr_t)TABLE_PTR(i) & ~PTR_FINALIZER_BIT);
   GC_MALLOC_RELEASE();
 }
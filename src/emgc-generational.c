@@ -0,0 +1,107 @@
+// emgc-generational.c implements the opt-in generational mode (-DEMGC_GENERATIONAL).
+// The collector does not move objects, so generations are tracked with "sticky" mark bits: the mark bits that a
+// collection sets are not cleared afterwards, and an allocation with its mark bit set belongs to the old generation.
+// A minor collection (gc_collect_minor()) keeps the old mark bits, so marking stops at any old object and only traces
+// and sweeps the allocations made since the previous collection. A major collection (gc_collect()) clears all mark bits
+// first, and traces the whole heap.
+// Pointers that are stored into old objects are not found by tracing young objects, so the program must report these
+// stores with gc_write_barrier() (or gc_store_ptr()). The barrier marks the card of the written address dirty in a card
+// table that has one byte per EMGC_CARD_SIZE bytes of the Wasm heap. A minor collection scans the managed allocations
+// that overlap dirty cards as roots.
+
+#ifdef EMGC_GENERATIONAL
+
+#ifndef EMGC_CARD_SIZE
+#define EMGC_CARD_SIZE 1024 // Granularity of the card table in bytes. Must be a power of two, at most HEAP_INDEX_PAGE_SIZE.
+#endif
+
+static uint8_t *card_table;
+static size_t num_cards;
+static int collecting_minor; // Set for the duration of a minor collection, including its sweep.
+
+__attribute__((constructor)) static void initialize_card_table()
+{
+  // Cover the maximum size of the heap up front, so that the barrier never needs to synchronize with a resize.
+  num_cards = (emscripten_get_heap_max() + EMGC_CARD_SIZE-1) / EMGC_CARD_SIZE;
+  card_table = (uint8_t*)calloc(num_cards, 1);
+  assert(card_table);
+}
+
+// The generational part of gc_write_barrier().
+static void mark_card_dirty(void *slot)
+{
+  size_t card = (uintptr_t)slot / EMGC_CARD_SIZE;
+  if (card < num_cards) card_table[card] = 1;
+}
+
+// Prepares the mark bits for a collection. Called with the GC lock held, before any thread starts marking.
+static void gen_begin_collection(int minor)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  collecting_minor = minor;
+  if (minor) return; // Keep the old generation marked.
+  clear_marks();
+  memset(card_table, 0, num_cards); // A major collection traces all old objects, so their stores need not be remembered.
+}
+
+// Marks the part of the allocation [ptr, ptr+bytes) that overlaps the card [start, end).
+static void mark_clipped(char *ptr, size_t bytes, uintptr_t start, uintptr_t end)
+{
+  uintptr_t s = ((uintptr_t)ptr > start) ? (uintptr_t)ptr : start, e = ((uintptr_t)ptr + bytes < end) ? (uintptr_t)ptr + bytes : end;
+  if (s < e) mark((void*)s, e - s);
+}
+
+// Marks the contents of all non-leaf managed allocations that overlap the card that starts at the given address. Only
+// managed memory is scanned, since unmanaged memory in the same card (e.g. the allocation table itself) may hold stale
+// pointers to young garbage. Arena pages and large object pages are aligned to the card size, so a card lies either
+// completely in an arena page, in a large object, or in the memory of table allocations.
+static void mark_card(uintptr_t start)
+{
+  uintptr_t end = start + EMGC_CARD_SIZE;
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of((void*)start);
+  if (page)
+  {
+    uint32_t i = (start > (uintptr_t)page->objects) ? (start - (uintptr_t)page->objects) / page->obj_size : 0;
+    for(; i < page->num_objects && (uintptr_t)page->objects + i * page->obj_size < end; ++i)
+      if (BITVEC_GET((uint8_t*)page->used, i) && !BITVEC_GET((uint8_t*)page->leaf, i))
+        mark_clipped(page->objects + i * page->obj_size, page->obj_size, start, end);
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_containing((void*)start);
+  if (span)
+  {
+    if (!span->leaf) mark_clipped(span->start, span->bytes, start, end);
+    return;
+  }
+#endif
+  // The table allocation that covers the start of the card, then each table allocation that starts inside the card.
+  uint32_t i = heap_index_find((void*)start);
+  for(uintptr_t bit = start / 8;;)
+  {
+    if (i != INVALID_INDEX && !HAS_LEAF_BIT(TABLE_PTR(i))) mark_clipped(REMOVE_FLAG_BITS(TABLE_PTR(i)), TABLE_SIZE(i), start, end);
+    uint64_t b = 0;
+    while(++bit < end / 8 && !(b = heap_index_starts[bit >> 6] >> (bit & 63))) bit |= 63; // Skip to the next start bit.
+    if (bit >= end / 8) break;
+    bit += __builtin_ctzll(b);
+    if (bit >= end / 8) break;
+    i = table_find((void*)(bit * 8));
+  }
+}
+
+// Scans the dirty cards over managed memory for pointers to young objects, and cleans the cards.
+static void mark_dirty_cards()
+{
+  if (!collecting_minor) return;
+  size_t end = managed_max_page * (HEAP_INDEX_PAGE_SIZE / EMGC_CARD_SIZE);
+  for(size_t card = managed_min_page * (HEAP_INDEX_PAGE_SIZE / EMGC_CARD_SIZE); card < end; ++card)
+    if (card_table[card])
+    {
+      card_table[card] = 0;
+      if (heap_index_maybe_managed(card * EMGC_CARD_SIZE)) mark_card(card * EMGC_CARD_SIZE);
+    }
+}
+
+#endif
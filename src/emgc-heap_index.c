@@ -0,0 +1,123 @@
+// emgc-heap_index.c maintains an address-ordered index of all managed allocations in the allocation table.
+// The heap is divided into 4KB pages. For each page, the index records a bitmap of the (8-byte aligned) addresses
+// where an allocation starts inside that page, and a "cover" pointer to the allocation that started in an earlier
+// page and extends into this page, if any. With this information, resolving the allocation that contains an arbitrary
+// address takes a constant amount of work: find the highest start bit at or below the address inside its page,
+// or if there is none, take the cover pointer of the page.
+// The index is updated when allocations are recorded to and freed from the allocation table, and covers the requested
+// size of each allocation, not the allocator slack after it. It is used by
+// gc_ptr_base(), and by the EMGC_INTERIOR_POINTERS marking mode.
+// (Small object arena allocations are not part of this index, since their base address is found by a division.)
+// Additionally, the index keeps a compact bitmap of the pages that any managed memory (table allocations, arena pages
+// and large objects) overlaps, along with the min/max bounds of that memory. Marking rejects candidate pointers
+// that fall outside these before doing any hash table probes.
+
+#define HEAP_INDEX_PAGE_SIZE 4096
+#define HEAP_INDEX_WORDS_PER_PAGE (HEAP_INDEX_PAGE_SIZE / 8 / 64)
+
+static uint64_t *heap_index_starts; // HEAP_INDEX_WORDS_PER_PAGE bitmap words per page.
+static void **heap_index_cover; // For each page, the allocation that covers the start of the page, but starts in an earlier page.
+static uint16_t *heap_index_page_refs; // For each page, the number of table allocations, arena pages and large objects that overlap it.
+static uint64_t *heap_index_page_bits; // One bit per page, set if the page has any references.
+static uint32_t heap_index_num_pages;
+// All managed memory lies in pages [managed_min_page, managed_max_page). The bounds are stored as page numbers rather than
+// addresses, so that global memory scanning won't mistake them for pointers to managed allocations.
+static uintptr_t managed_min_page, managed_max_page;
+
+static void heap_index_grow(uintptr_t end)
+{
+  uint32_t num_pages = (uint32_t)(((uintptr_t)emscripten_get_heap_size() + HEAP_INDEX_PAGE_SIZE-1) / HEAP_INDEX_PAGE_SIZE);
+  assert(end <= (uintptr_t)num_pages * HEAP_INDEX_PAGE_SIZE);
+  heap_index_starts = (uint64_t*)realloc(heap_index_starts, (size_t)num_pages * HEAP_INDEX_WORDS_PER_PAGE * sizeof(uint64_t));
+  heap_index_cover = (void**)realloc(heap_index_cover, (size_t)num_pages * sizeof(void*));
+  heap_index_page_refs = (uint16_t*)realloc(heap_index_page_refs, (size_t)num_pages * sizeof(uint16_t));
+  heap_index_page_bits = (uint64_t*)realloc(heap_index_page_bits, (size_t)(num_pages+63) / 64 * sizeof(uint64_t));
+  assert(heap_index_starts && heap_index_cover && heap_index_page_refs && heap_index_page_bits); // These allocations must be infallible.
+  memset(heap_index_starts + (size_t)heap_index_num_pages * HEAP_INDEX_WORDS_PER_PAGE, 0, (size_t)(num_pages - heap_index_num_pages) * HEAP_INDEX_WORDS_PER_PAGE * sizeof(uint64_t));
+  memset(heap_index_cover + heap_index_num_pages, 0, (size_t)(num_pages - heap_index_num_pages) * sizeof(void*));
+  memset(heap_index_page_refs + heap_index_num_pages, 0, (size_t)(num_pages - heap_index_num_pages) * sizeof(uint16_t));
+  memset(heap_index_page_bits + (heap_index_num_pages+63) / 64, 0, ((size_t)(num_pages+63) / 64 - (heap_index_num_pages+63) / 64) * sizeof(uint64_t));
+  heap_index_num_pages = num_pages;
+}
+
+// Adds (delta = 1) or removes (delta = -1) a reference from all pages that overlap the address range [start, end).
+static void heap_index_ref_pages(uintptr_t start, uintptr_t end, int delta)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  if (end > (uintptr_t)heap_index_num_pages * HEAP_INDEX_PAGE_SIZE) heap_index_grow(end);
+  for(uintptr_t page = start / HEAP_INDEX_PAGE_SIZE; page <= (end-1) / HEAP_INDEX_PAGE_SIZE; ++page)
+  {
+    assert(delta > 0 || heap_index_page_refs[page] > 0);
+    if ((heap_index_page_refs[page] += delta)) heap_index_page_bits[page >> 6] |= 1ull << (page & 63);
+    else heap_index_page_bits[page >> 6] &= ~(1ull << (page & 63));
+  }
+  if (delta > 0) // Widen the bounds right away. They are tightened back after each sweep.
+  {
+    if (!managed_max_page || start / HEAP_INDEX_PAGE_SIZE < managed_min_page) managed_min_page = start / HEAP_INDEX_PAGE_SIZE;
+    if ((end-1) / HEAP_INDEX_PAGE_SIZE >= managed_max_page) managed_max_page = (end-1) / HEAP_INDEX_PAGE_SIZE + 1;
+  }
+}
+
+// Tightens the managed memory bounds to the first and last pages that are still referenced.
+static void heap_index_update_bounds()
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t num_words = (heap_index_num_pages+63) / 64, first = 0, last = num_words;
+  while(first < num_words && !heap_index_page_bits[first]) ++first;
+  if (first == num_words)
+  {
+    managed_min_page = managed_max_page = 0;
+    return;
+  }
+  while(!heap_index_page_bits[last-1]) --last;
+  managed_min_page = (uintptr_t)first*64 + __builtin_ctzll(heap_index_page_bits[first]);
+  managed_max_page = (uintptr_t)last*64 - __builtin_clzll(heap_index_page_bits[last-1]);
+}
+
+// Returns nonzero if the given address lies in a page that overlaps some managed memory.
+static int heap_index_maybe_managed(uintptr_t ptr)
+{
+  uintptr_t page = ptr / HEAP_INDEX_PAGE_SIZE;
+  if (page - managed_min_page >= managed_max_page - managed_min_page) return 0;
+  return (heap_index_page_bits[page >> 6] >> (page & 63)) & 1;
+}
+
+static void heap_index_insert(void *ptr, size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uintptr_t start = (uintptr_t)ptr, end = start + (bytes ? bytes : 1);
+  heap_index_ref_pages(start, end, 1);
+  uintptr_t bit = start / 8;
+  heap_index_starts[bit >> 6] |= 1ull << (bit & 63);
+  for(uintptr_t page = start / HEAP_INDEX_PAGE_SIZE + 1; page <= (end-1) / HEAP_INDEX_PAGE_SIZE; ++page)
+    heap_index_cover[page] = ptr;
+}
+
+static void heap_index_remove(void *ptr, size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uintptr_t start = (uintptr_t)ptr, end = start + (bytes ? bytes : 1);
+  uintptr_t bit = start / 8;
+  heap_index_starts[bit >> 6] &= ~(1ull << (bit & 63));
+  for(uintptr_t page = start / HEAP_INDEX_PAGE_SIZE + 1; page <= (end-1) / HEAP_INDEX_PAGE_SIZE; ++page)
+    heap_index_cover[page] = 0;
+  heap_index_ref_pages(start, end, -1);
+}
+
+// Returns the table index of the allocation that contains the given address, or INVALID_INDEX if there is none.
+static uint32_t heap_index_find(void *ptr)
+{
+  uintptr_t page = (uintptr_t)ptr / HEAP_INDEX_PAGE_SIZE;
+  if (page >= heap_index_num_pages) return INVALID_INDEX;
+
+  // Search the start bitmap of this page backwards, starting from the bit of ptr.
+  uintptr_t bit = (uintptr_t)ptr / 8;
+  uint64_t *words = heap_index_starts + page * HEAP_INDEX_WORDS_PER_PAGE;
+  uint32_t w = (bit >> 6) - page * HEAP_INDEX_WORDS_PER_PAGE;
+  uint64_t b = words[w] & ((2ull << (bit & 63)) - 1); // Mask off all start addresses after ptr.
+  while(!b && w > 0) b = words[--w];
+
+  void *base = b ? (void*)(page * HEAP_INDEX_PAGE_SIZE + ((w << 6) + 63 - __builtin_clzll(b)) * 8) : heap_index_cover[page];
+  uint32_t i = base ? table_find(base) : INVALID_INDEX;
+  return (i != INVALID_INDEX && (uintptr_t)ptr - (uintptr_t)base < (TABLE_SIZE(i) ? TABLE_SIZE(i) : 1)) ? i : INVALID_INDEX;
+}
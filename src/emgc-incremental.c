@@ -0,0 +1,165 @@
+// emgc-incremental.c implements incremental collection with gc_collect_step(). Instead of marking recursively, an
+// incremental collection keeps the allocations that it has marked but not yet scanned (the grey objects) in an explicit
+// grey stack, and each gc_collect_step() call scans objects off the stack until its time budget runs out. Large objects
+// are scanned INCREMENTAL_SCAN_CHUNK bytes at a time, so that a single step does not overrun its budget by much. Typed
+// allocations are scanned whole, since they only need their declared pointer slots to be looked at.
+// While marking is in progress the program keeps running, so the write barrier marks the pointer that is stored into a
+// managed allocation (a Dijkstra style insertion barrier), so that no scanned allocation ends up pointing to an
+// allocation that has not been marked. Stores to static data and the stack do not go through the barrier, so once the
+// grey stack runs empty, the roots are scanned again, and marking is completed without a time budget.
+// Allocations made during an incremental collection are created marked. The sweep then frees the unmarked allocations
+// in the table a few groups at a time.
+// Incremental collection is not available in multithreaded builds, where gc_collect_step() performs a gc_collect().
+
+#ifndef __EMSCRIPTEN_SHARED_MEMORY__
+
+#define INCREMENTAL_SCAN_CHUNK 4096 // Max bytes of an object to scan at a time. Must be a multiple of 16.
+#define INCREMENTAL_SWEEP_GROUPS 64 // Number of table groups to sweep between checking the time budget.
+
+static mark_item *grey_stack;
+static uint32_t grey_stack_size, grey_stack_capacity;
+static uint32_t incremental_sweep_group;
+static table_group *incremental_sweep_table; // The table that the sweep cursor above refers to.
+
+static void grey_push(void *ptr, size_t bytes, gc_type type)
+{
+  if (grey_stack_size == grey_stack_capacity)
+  {
+    uint32_t capacity = grey_stack_capacity ? 2*grey_stack_capacity : 1024;
+    mark_item *stack = (mark_item*)realloc(grey_stack, capacity*sizeof(mark_item));
+    if (!stack)
+    {
+      scan_item((mark_item){ ptr, bytes, type }); // Out of memory to grow the grey stack, so scan the object recursively right away.
+      return;
+    }
+    grey_stack = stack;
+    grey_stack_capacity = capacity;
+  }
+  grey_stack[grey_stack_size++] = (mark_item){ ptr, bytes, type };
+}
+
+// Scans the grey objects until the grey stack is empty, or the given deadline (in msecs) passes. At least one object is
+// scanned per call, so that collection makes progress even with a zero budget. Returns 1 if the grey stack got empty.
+static int incremental_mark(double deadline)
+{
+  while(grey_stack_size > 0)
+  {
+    mark_item item = grey_stack[--grey_stack_size];
+    if (item.bytes > INCREMENTAL_SCAN_CHUNK && !item.type) // Put the rest of the object back to the stack for later.
+    {
+      grey_push((char*)item.ptr + INCREMENTAL_SCAN_CHUNK, item.bytes - INCREMENTAL_SCAN_CHUNK, 0);
+      item.bytes = INCREMENTAL_SCAN_CHUNK;
+    }
+    scan_item(item);
+    if (emscripten_performance_now() >= deadline) break;
+  }
+  return grey_stack_size == 0;
+}
+
+// Sweeps the table groups until all of them have been swept, or the given deadline passes. Returns 1 when done.
+static int incremental_sweep(double deadline)
+{
+  table_finish_migration();
+  if (table != incremental_sweep_table) // Allocations made during the sweep resized the table, so start over. Only garbage is unmarked.
+  {
+    incremental_sweep_table = table;
+    incremental_sweep_group = 0;
+  }
+  while(incremental_sweep_group <= table_mask / TABLE_GROUP_SIZE)
+  {
+    uint32_t end = incremental_sweep_group + INCREMENTAL_SWEEP_GROUPS;
+    for(uint32_t g = incremental_sweep_group; g < end && g <= table_mask / TABLE_GROUP_SIZE; ++g)
+      for(uint32_t b = table[g].used & ~(uint32_t)table[g].mark, offset; b; b ^= 1u << offset)
+        table_free(g*TABLE_GROUP_SIZE + (offset = __builtin_ctz(b)));
+    incremental_sweep_group = end;
+    if (incremental_sweep_group <= table_mask / TABLE_GROUP_SIZE && emscripten_performance_now() >= deadline) return 0;
+  }
+
+  if (((8*num_allocs)|table_min_mask) < table_mask || 8*(num_table_entries - num_allocs) > table_mask) realloc_table();
+#ifndef EMGC_GENERATIONAL // Clear the marks for the next collection, including the marks of the allocations made during this one.
+  clear_marks();
+#endif
+  live_bytes_after_collect = managed_bytes;
+  heap_index_update_bounds();
+  incremental_phase = INCREMENTAL_IDLE;
+  run_finalizers_after_collection();
+  return 1;
+}
+
+// Always inlined, so that the incremental collection entry point does not add an extra frame to the stack, see collect().
+static inline __attribute__((always_inline)) int collect_step(double nsecs)
+{
+  double deadline = emscripten_performance_now() + nsecs/1000000.0;
+  if (incremental_phase == INCREMENTAL_IDLE)
+  {
+    bytes_allocated_since_collect = 0;
+    pacing_collection_pending = 0;
+    num_finalizers_marked = 0;
+    begin_collection_locked(0);
+    incremental_phase = INCREMENTAL_MARKING;
+    mark_roots(); // With marking in progress, the roots are only greyed here. Scanning them happens in the steps.
+  }
+  if (incremental_phase == INCREMENTAL_MARKING)
+  {
+    if (!incremental_mark(deadline)) return 0;
+
+    // Complete the marking: roots may have changed without a barrier since they were first scanned.
+    mark_roots();
+    incremental_mark(__builtin_inf());
+
+    incremental_phase = INCREMENTAL_SWEEPING; // Set first, so that marking from the finalizable garbage is not greyed.
+    if (num_finalizers_marked < num_finalizers) queue_unreachable_finalizers();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+    arena_sweep(num_weak_ptrs > 0);
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+    los_sweep(num_weak_ptrs > 0);
+#endif
+    incremental_sweep_table = table;
+    incremental_sweep_group = 0;
+    if (emscripten_performance_now() >= deadline) return 0;
+  }
+  return incremental_sweep(deadline);
+}
+
+int gc_collect_step(double nsecs) { return collect_step(nsecs); }
+
+static void scan_object(void *ptr, size_t bytes, gc_type type)
+{
+  if (incremental_phase == INCREMENTAL_MARKING) grey_push(ptr, bytes, type);
+  else mark_stack_push((mark_item){ ptr, bytes, type });
+}
+
+#else
+int gc_collect_step(double nsecs)
+{
+  gc_collect();
+  return 1;
+}
+
+static void scan_object(void *ptr, size_t bytes, gc_type type) { scan_item((mark_item){ ptr, bytes, type }); }
+#endif
+
+void gc_write_barrier(void *slot)
+{
+#ifdef EMGC_GENERATIONAL
+  mark_card_dirty(slot);
+#endif
+#ifndef __EMSCRIPTEN_SHARED_MEMORY__
+  if (incremental_phase == INCREMENTAL_MARKING) mark_maybe_ptr(*(void**)slot); // Grey the stored pointer.
+#endif
+}
+
+void gc_pre_write_barrier(void *slot)
+{
+#ifdef EMGC_CONCURRENT_MARKING
+  if (incremental_phase == INCREMENTAL_MARKING) satb_log(*(void**)slot); // Log the pointer that is about to be overwritten.
+#endif
+}
+
+void gc_store_ptr(void **slot __attribute__((nonnull)), void *ptr)
+{
+  gc_pre_write_barrier(slot);
+  *slot = ptr;
+  gc_write_barrier(slot);
+}
@@ -0,0 +1,249 @@
+// emgc-large_object_space.c implements an optional large object space. Build with -DEMGC_LARGE_OBJECT_SPACE to enable it.
+// Allocations of at least EMGC_LARGE_OBJECT_THRESHOLD bytes are then not malloc()ed, but served as spans of page
+// aligned 64KB pages, carved out of big regions that the large object space reserves from the system allocator.
+// Large objects do not occupy slots in the managed allocation hash table: each span has its own header, and a page map
+// resolves any address to the span that covers it in constant time. Freed spans are coalesced with their free
+// neighbours, and regions that become completely free are given back to the system allocator.
+// Marking skips leaf spans altogether. In multithreaded builds other spans are scanned in EMGC_SCAN_CHUNK_SIZE pieces
+// by all marking threads, like any large object (see emgc-work_stealing.c).
+
+#ifdef EMGC_LARGE_OBJECT_SPACE
+
+#ifndef EMGC_LARGE_OBJECT_THRESHOLD
+#define EMGC_LARGE_OBJECT_THRESHOLD (1024*1024) // Smallest allocation size (in bytes) that is served from the large object space.
+#endif
+#define LOS_PAGE_SIZE 65536
+#define LOS_REGION_SIZE (4*1024*1024) // Minimum amount of memory to reserve from the system allocator at a time.
+#define LOS_NUM_BINS 32 // Free spans are binned by the power of two of their length in pages.
+
+typedef struct los_span
+{
+  char *start;
+  size_t num_pages, bytes; // Length of the span in pages, and the requested allocation size if the span is in use.
+  struct los_span *prev, *next; // Physically adjacent spans in the same region, or null at region boundaries.
+  uint32_t index; // Index of this span in los_spans if in use, or in its free bin if free.
+  uint8_t used, mark, leaf, finalizer;
+} los_span;
+
+typedef struct los_span_list
+{
+  los_span **spans;
+  uint32_t num, cap;
+} los_span_list;
+
+static los_span_list los_spans, los_free_bins[LOS_NUM_BINS]; // Spans that are in use, and free spans binned by their length.
+static los_span **los_page_map; // For each 64KB page of the heap, the used span that covers it, or null.
+static uint32_t los_num_map_pages, los_num_allocs;
+
+static void los_list_add(los_span_list *list, los_span *span)
+{
+  if (list->num == list->cap)
+  {
+    list->cap = (list->cap*2) | 15;
+    list->spans = (los_span**)realloc(list->spans, list->cap * sizeof(los_span*));
+    assert(list->spans); // This allocation must be infallible.
+  }
+  span->index = list->num;
+  list->spans[list->num++] = span;
+}
+
+static void los_list_remove(los_span_list *list, los_span *span)
+{
+  list->spans[span->index] = list->spans[--list->num];
+  list->spans[span->index]->index = span->index;
+}
+
+static los_span_list *los_free_bin(size_t num_pages)
+{
+  uint32_t bin = 31 - __builtin_clz((uint32_t)num_pages);
+  return &los_free_bins[bin < LOS_NUM_BINS ? bin : LOS_NUM_BINS-1];
+}
+
+static los_span *los_new_span(char *start, size_t num_pages)
+{
+  los_span *span = (los_span*)calloc(1, sizeof(los_span));
+  assert(span); // This allocation must be infallible.
+  span->start = start;
+  span->num_pages = num_pages;
+  return span;
+}
+
+// Returns the large object that contains the address ptr, or null if there is none.
+static los_span *los_span_containing(void *ptr)
+{
+  uintptr_t p = (uintptr_t)ptr / LOS_PAGE_SIZE;
+  los_span *span = (p < los_num_map_pages) ? los_page_map[p] : 0;
+  return (span && (uintptr_t)ptr - (uintptr_t)span->start < span->bytes) ? span : 0;
+}
+
+// Returns the large object that starts at address ptr, or null if ptr does not point to the start of a large object.
+static los_span *los_span_of(void *ptr)
+{
+  los_span *span = los_span_containing(ptr);
+  return (span && span->start == (char*)ptr) ? span : 0;
+}
+
+#ifdef EMGC_INTERIOR_POINTERS
+#define LOS_MARK_SPAN(ptr) los_span_containing(ptr)
+#else
+#define LOS_MARK_SPAN(ptr) los_span_of(ptr)
+#endif
+
+static void los_map_span(los_span *span, los_span *value)
+{
+  uintptr_t end = (uintptr_t)span->start + span->num_pages * LOS_PAGE_SIZE;
+  if (end > (uintptr_t)los_num_map_pages * LOS_PAGE_SIZE)
+  {
+    uint32_t num_pages = (uint32_t)(((uintptr_t)emscripten_get_heap_size() + LOS_PAGE_SIZE-1) / LOS_PAGE_SIZE);
+    assert(end <= (uintptr_t)num_pages * LOS_PAGE_SIZE);
+    los_page_map = (los_span**)realloc(los_page_map, (size_t)num_pages * sizeof(los_span*));
+    assert(los_page_map); // This allocation must be infallible.
+    memset(los_page_map + los_num_map_pages, 0, (size_t)(num_pages - los_num_map_pages) * sizeof(los_span*));
+    los_num_map_pages = num_pages;
+  }
+  for(uintptr_t p = (uintptr_t)span->start / LOS_PAGE_SIZE; p < end / LOS_PAGE_SIZE; ++p) los_page_map[p] = value;
+}
+
+static void *los_malloc_locked(size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  if (!table) realloc_table(); // The rest of the collector assumes that the allocation table always exists after the first allocation.
+  size_t num_pages = bytes / LOS_PAGE_SIZE + (bytes % LOS_PAGE_SIZE != 0);
+  if (num_pages >= SIZE_MAX / LOS_PAGE_SIZE) return 0;
+
+  // Find a free span from the smallest bin that has one that fits, or reserve a new region if none fits.
+  // Only the first searched bin may hold spans that are too short, any span in a larger bin fits.
+  los_span *span = 0;
+  for(los_span_list *bin = los_free_bin(num_pages); bin < los_free_bins + LOS_NUM_BINS && !span; ++bin)
+    for(uint32_t i = 0; i < bin->num && !span; ++i)
+      if (bin->spans[i]->num_pages >= num_pages) span = bin->spans[i];
+  if (span) los_list_remove(los_free_bin(span->num_pages), span);
+  else
+  {
+    size_t region_pages = (num_pages > LOS_REGION_SIZE / LOS_PAGE_SIZE) ? num_pages : LOS_REGION_SIZE / LOS_PAGE_SIZE;
+    char *region = (char*)aligned_alloc(LOS_PAGE_SIZE, region_pages * LOS_PAGE_SIZE);
+    if (!region && region_pages > num_pages) region = (char*)aligned_alloc(LOS_PAGE_SIZE, (region_pages = num_pages) * LOS_PAGE_SIZE);
+    if (!region) return 0;
+    span = los_new_span(region, region_pages);
+  }
+
+  if (span->num_pages > num_pages) // Split the unused tail of the span back to the free list.
+  {
+    los_span *rest = los_new_span(span->start + num_pages * LOS_PAGE_SIZE, span->num_pages - num_pages);
+    rest->prev = span;
+    if ((rest->next = span->next)) rest->next->prev = rest;
+    span->next = rest;
+    span->num_pages = num_pages;
+    los_list_add(los_free_bin(rest->num_pages), rest);
+  }
+
+  span->used = 1;
+  span->mark = (incremental_phase != INCREMENTAL_IDLE);
+  span->bytes = bytes;
+  los_list_add(&los_spans, span);
+  los_map_span(span, span);
+  heap_index_ref_pages((uintptr_t)span->start, (uintptr_t)span->start + num_pages * LOS_PAGE_SIZE, 1);
+  ++los_num_allocs;
+  pacing_count_malloc(span->num_pages * LOS_PAGE_SIZE);
+  return span->start;
+}
+
+static void *los_malloc(size_t bytes)
+{
+  GC_MALLOC_ACQUIRE();
+  void *ptr = los_malloc_locked(bytes);
+  GC_MALLOC_RELEASE();
+  return ptr;
+}
+
+// Resizes the given large object in place, taking pages from the free span that follows it if it needs to grow.
+// Returns 0 if the object cannot grow in place. Shrinking keeps the pages of the span.
+static int los_resize_in_place(los_span *span, size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  size_t num_pages = bytes / LOS_PAGE_SIZE + (bytes % LOS_PAGE_SIZE != 0);
+  if (num_pages > span->num_pages)
+  {
+    los_span *next = span->next;
+    if (!next || next->used || span->num_pages + next->num_pages < num_pages) return 0;
+    size_t taken = num_pages - span->num_pages;
+    los_list_remove(los_free_bin(next->num_pages), next);
+    if (taken == next->num_pages)
+    {
+      if ((span->next = next->next)) span->next->prev = span;
+      free(next);
+    }
+    else
+    {
+      next->start += taken * LOS_PAGE_SIZE;
+      next->num_pages -= taken;
+      los_list_add(los_free_bin(next->num_pages), next);
+    }
+    heap_index_ref_pages((uintptr_t)span->start + span->num_pages * LOS_PAGE_SIZE, (uintptr_t)span->start + num_pages * LOS_PAGE_SIZE, 1);
+    span->num_pages = num_pages;
+    los_map_span(span, span);
+    pacing_count_malloc(taken * LOS_PAGE_SIZE);
+  }
+  span->bytes = bytes;
+  return 1;
+}
+
+// Frees the given large object. Caller must have already detached roots, finalizers and weak pointers of the object.
+static void los_free(los_span *span)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  concurrent_mark_freed(span->start, span->bytes, span->leaf);
+  los_map_span(span, 0);
+  heap_index_ref_pages((uintptr_t)span->start, (uintptr_t)span->start + span->num_pages * LOS_PAGE_SIZE, -1);
+  los_list_remove(&los_spans, span);
+  --los_num_allocs;
+  pacing_count_free(span->num_pages * LOS_PAGE_SIZE);
+  span->used = span->mark = span->leaf = span->finalizer = 0;
+  span->bytes = 0;
+
+  // Coalesce the span with its free neighbours.
+  los_span *next = span->next, *prev = span->prev;
+  if (next && !next->used)
+  {
+    los_list_remove(los_free_bin(next->num_pages), next);
+    span->num_pages += next->num_pages;
+    if ((span->next = next->next)) span->next->prev = span;
+    free(next);
+  }
+  if (prev && !prev->used)
+  {
+    los_list_remove(los_free_bin(prev->num_pages), prev);
+    prev->num_pages += span->num_pages;
+    if ((prev->next = span->next)) prev->next->prev = prev;
+    free(span);
+    span = prev;
+  }
+
+  if (!span->prev && !span->next) // The whole region is now free, so give it back to the system allocator.
+  {
+    free(span->start);
+    free(span);
+  }
+  else los_list_add(los_free_bin(span->num_pages), span);
+}
+
+// Sweeps all large objects: frees unmarked objects, and clears the mark bits for the next collection.
+static void los_sweep(int detach_weak_ptrs)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  for(uint32_t i = 0; i < los_spans.num; ++i)
+  {
+    los_span *span = los_spans.spans[i];
+    if (!span->mark)
+    {
+      if (detach_weak_ptrs) remove_weak_ptr(span->start);
+      los_free(span); // Moves the last span of the list to index i.
+      --i;
+    }
+#ifndef EMGC_GENERATIONAL // In generational mode, the mark bits stick to tell the old generation apart.
+    else span->mark = 0;
+#endif
+  }
+}
+
+#endif
@@ -1,65 +1,180 @@
 #ifdef __EMSCRIPTEN_SHARED_MEMORY__
+// Scans the unclaimed root chunks, and then allocations from this thread's deque, and steals from other threads when it
+// runs empty, until no thread has any work left.
 static void mark_from_queue()
 {
-  for(;;)
+  ++num_threads_marking;
+  this_thread_batching_pushes = 1;
+  for(mark_item item;;)
   {
-    uint32_t tail = queue_tail;
-again:
-    if (tail >= consumer_head) break;
-    void *ptr = mark_queue[tail & MARK_QUEUE_MASK];
-    uint32_t actual = cas_u32(&queue_tail, tail, tail+1);
-    if (actual != tail) { tail = actual; goto again; }
-
-    mark(ptr, malloc_usable_size(ptr));
+    mark_publish(); // Let other threads steal the children of the previously scanned object.
+    if (mark_root_chunk()) continue;
+    if (mark_next(&item))
+    {
+      scan_item(item);
+      continue;
+    }
+    // Out of work. Threads that are still scanning may push more, so wait for either work to appear, or all threads to
+    // run out of work.
+    --num_threads_marking;
+    while(num_threads_marking > 0 && !mark_work_available()) gc_uninterrupted_sleep(1);
+    if (!mark_work_available()) break;
+    ++num_threads_marking;
+    int overflowed = 1;
+    if (__c11_atomic_compare_exchange_strong(&mark_overflowed, &overflowed, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) mark_rescan(); // Recover from an overflow, while the other threads wait for the work that it finds.
   }
+  this_thread_batching_pushes = 0;
   wait_for_all_threads_finished_marking();
 }
 
-static void mark_maybe_ptr(void *ptr)
+// Atomically sets bit i in the given bitmap. Returns nonzero if this thread was the one to set it.
+static int atomic_bitvec_set(uint8_t *bitmap, uint32_t i)
 {
-  if (!gc_looks_like_ptr((uintptr_t)ptr)) return; // Early-out if the ptr does not look like a managed pointer at all.
-
-  uint32_t i = table_find(ptr);
-  if (i == INVALID_INDEX) return;
   uint8_t bit = ((uint8_t)1 << (i&7));
-  _Atomic(uint8_t) *marks = (_Atomic(uint8_t)*)mark_table + (i>>3);
+  _Atomic(uint8_t) *marks = (_Atomic(uint8_t)*)bitmap + (i>>3);
   uint8_t old = *marks;
 again_bit:
-  if ((old & bit)) return; // This pointer is already marked? Then can skip it.
+  if ((old & bit)) return 0; // This pointer is already marked? Then can skip it.
   uint8_t actual = cas_u8(marks, old, old | bit);
   if (old != actual) { old = actual; goto again_bit; } // Some other bit in this byte got flipped by another thread, retry marking this.
+  return 1;
+}
 
-  if (HAS_FINALIZER_BIT(table[i])) emscripten_atomic_add_u32(&num_finalizers_marked, 1);
-  if (!HAS_LEAF_BIT(table[i]))
+// Marks the allocation ptr in table slot i, and queues it for scanning if this thread was the one to mark it.
+static void mark_table_slot(uint32_t i, void *ptr)
+{
+  if (!atomic_bitvec_set((uint8_t*)&table[i / TABLE_GROUP_SIZE].mark, i % TABLE_GROUP_SIZE)) return;
+  if (HAS_FINALIZER_BIT(TABLE_PTR(i))) emscripten_atomic_add_u32(&num_finalizers_marked, 1);
+  if (!HAS_LEAF_BIT(TABLE_PTR(i))) mark_push((mark_item){ ptr, TABLE_SIZE(i), table_type(i) });
+}
+
+static void mark_maybe_ptr(void *ptr)
+{
+  if (!mark_looks_like_ptr((uintptr_t)ptr)) return; // Early-out if the ptr does not look like a managed pointer at all.
+
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = LOS_MARK_SPAN(ptr);
+  if (span)
   {
-    uint32_t head = producer_head;
-again_head:
-    if (head >= queue_tail + MARK_QUEUE_MASK) mark(ptr, malloc_usable_size(ptr)); // The shared work queue is full, so mark unshared recursively on local stack
-    else
-    {
-      uint32_t actual = cas_u32(&producer_head, head, head+1);
-      if (actual != head) { head = actual; goto again_head; }
-      mark_queue[head & MARK_QUEUE_MASK] = ptr;
-      while(cas_u32(&consumer_head, head, head+1) != head) ; // nop
-    }
+    if (!atomic_bitvec_set(&span->mark, 0)) return;
+    if (span->finalizer) emscripten_atomic_add_u32(&num_finalizers_marked, 1);
+    if (!span->leaf) mark_push((mark_item){ span->start, span->bytes, 0 }); // mark_next() splits the scanning to all marking threads.
+    return;
+  }
+#endif
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    uint32_t i = ARENA_MARK_INDEX(page, ptr);
+    if (i == INVALID_INDEX || !atomic_bitvec_set((uint8_t*)page->mark, i)) return;
+    if (BITVEC_GET((uint8_t*)page->finalizer, i)) emscripten_atomic_add_u32(&num_finalizers_marked, 1);
+    if (!BITVEC_GET((uint8_t*)page->leaf, i)) mark_push((mark_item){ page->objects + i * page->obj_size, page->obj_size, 0 });
+    return;
   }
+#endif
+  uint32_t i = table_find(ptr);
+#ifdef EMGC_INTERIOR_POINTERS
+  if (i == INVALID_INDEX && (i = heap_index_find(ptr)) != INVALID_INDEX) ptr = REMOVE_FLAG_BITS(TABLE_PTR(i));
+#endif
+  if (i != INVALID_INDEX) mark_table_slot(i, ptr);
 }
 #else
+// Marks the allocation ptr in table slot i, and scans it if it was not marked yet.
+static void mark_table_slot(uint32_t i, void *ptr)
+{
+  if (TABLE_IS_MARKED(i)) return;
+  TABLE_SET_MARK(i);
+  num_finalizers_marked += HAS_FINALIZER_BIT(TABLE_PTR(i));
+  if (!HAS_LEAF_BIT(TABLE_PTR(i))) scan_object(ptr, TABLE_SIZE(i), table_type(i));
+}
+
 static void mark_maybe_ptr(void *ptr)
 {
-  if (!gc_looks_like_ptr((uintptr_t)ptr)) return; // Early-out if the ptr does not look like a managed pointer at all.
+  if (!mark_looks_like_ptr((uintptr_t)ptr)) return; // Early-out if the ptr does not look like a managed pointer at all.
 
-  uint32_t i = table_find(ptr);
-  if (i != INVALID_INDEX && !BITVEC_GET(mark_table, i))
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    uint32_t i = ARENA_MARK_INDEX(page, ptr);
+    if (i != INVALID_INDEX && !BITVEC_GET((uint8_t*)page->mark, i))
+    {
+      BITVEC_SET((uint8_t*)page->mark, i);
+      num_finalizers_marked += BITVEC_GET((uint8_t*)page->finalizer, i);
+      if (!BITVEC_GET((uint8_t*)page->leaf, i)) scan_object(page->objects + i * page->obj_size, page->obj_size, 0);
+    }
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = LOS_MARK_SPAN(ptr);
+  if (span)
   {
-    BITVEC_SET(mark_table, i);
-    num_finalizers_marked += HAS_FINALIZER_BIT(table[i]);
-    if (!HAS_LEAF_BIT(table[i])) mark(ptr, malloc_usable_size(ptr));
+    if (!span->mark)
+    {
+      span->mark = 1;
+      num_finalizers_marked += span->finalizer;
+      if (!span->leaf) scan_object(span->start, span->bytes, 0);
+    }
+    return;
   }
+#endif
+  uint32_t i = table_find(ptr);
+#ifdef EMGC_INTERIOR_POINTERS
+  if (i == INVALID_INDEX && (i = heap_index_find(ptr)) != INVALID_INDEX) ptr = REMOVE_FLAG_BITS(TABLE_PTR(i));
+#endif
+  if (i != INVALID_INDEX) mark_table_slot(i, ptr);
 }
 #endif
 
+static int mark_batched_lookups = 1; // If 0, the SIMD marking kernel looks up its candidates one at a time. See debug_gc_set_batched_mark_lookups().
+
 #ifdef __wasm_simd128__
+#define MARK_BATCH_SIZE 16 // Number of candidate pointers that the SIMD marking kernel collects before looking them up.
+
+// Marks the n candidate pointers in batch. The table lookups are staged, so that the loads of the home groups of all
+// candidates are independent of each other, and their cache misses can overlap: first all hashes are computed, then
+// all home groups are matched, and only then are the found allocations marked, which may scan them. A candidate whose
+// lookup is not decided by its home group alone (e.g. its probe sequence continues to the next group) is looked up
+// with mark_maybe_ptr() as usual.
+static void mark_batch(void **batch, uint32_t n)
+{
+  void *ptrs[2*MARK_BATCH_SIZE];
+  uint32_t hashes[2*MARK_BATCH_SIZE], found[2*MARK_BATCH_SIZE], num = 0;
+  for(uint32_t i = 0; i < n; ++i)
+  {
+    void *ptr = batch[i];
+    if (!mark_batched_lookups || !table) { mark_maybe_ptr(ptr); continue; }
+    if (!mark_looks_like_ptr((uintptr_t)ptr)) continue;
+#ifdef EMGC_SMALL_OBJECT_ARENA
+    if (arena_page_of(ptr)) { mark_maybe_ptr(ptr); continue; }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+    if (LOS_MARK_SPAN(ptr)) { mark_maybe_ptr(ptr); continue; }
+#endif
+    ptrs[num] = ptr;
+    hashes[num++] = hash_ptr(ptr);
+  }
+
+  const uint32_t group_mask = table_mask / TABLE_GROUP_SIZE;
+  for(uint32_t i = 0; i < num; ++i)
+  {
+    const table_group *group = &table[hashes[i] & group_mask];
+    found[i] = INVALID_INDEX-1; // Undecided.
+    for(uint32_t bits = group_match(group, hashes[i] >> 25), offset; bits; bits ^= 1u << offset)
+      if (REMOVE_FLAG_BITS(group->ptrs[offset = __builtin_ctz(bits)]) == ptrs[i])
+        found[i] = (hashes[i] & group_mask) * TABLE_GROUP_SIZE + offset;
+#ifndef EMGC_INTERIOR_POINTERS // Otherwise a miss is resolved through the heap index.
+    if (found[i] == INVALID_INDEX-1 && !old_table && group_match(group, CTRL_EMPTY)) found[i] = INVALID_INDEX;
+#endif
+  }
+
+  for(uint32_t i = 0; i < num; ++i)
+    if (found[i] == INVALID_INDEX-1) mark_maybe_ptr(ptrs[i]);
+    else if (found[i] != INVALID_INDEX) mark_table_slot(found[i], ptrs[i]);
+}
+
 // This function performs a memory load that can deliberately go out of bounds for performance - in WebAssembly that is
 // benign, as long as the OOB is not out of the Wasm Memory altogether (which we ensure outside by over-reserving the
 // Wasm heap). We do this for conservative marking, so accessing some random data beyond the ptr end is not a problem.
@@ -69,23 +184,53 @@ v128_t wasm_v128_out_of_bounds_load(const void *ptr)
   return wasm_v128_load(ptr);
 }
 
+// Adds the lanes of ptrs that are set in the cmp mask to the batch of candidates. A value that repeats the previous
+// candidate is skipped, since runs of the same pointer are common in arrays.
+#define MARK_CANDIDATES(p, cmp) \
+  for(uint32_t bits = wasm_i32x4_bitmask(cmp), offset; bits; bits ^= 1 << offset) \
+  { \
+    void *c = (p)[(offset = __builtin_ctz(bits))]; \
+    if (c != prev) batch[num_batched++] = prev = c; \
+  }
+
+// Marks the memory range. SIMD filtering finds the words that fall in managed memory and are aligned like managed
+// pointers, and only these are looked up in the allocation table, in batches of at least MARK_BATCH_SIZE candidates.
 static void mark(void *ptr, size_t bytes)
 {
   assert(IS_ALIGNED(ptr, sizeof(void*)));
 
-  const v128_t mem_start = wasm_u32x4_splat((uintptr_t)&__heap_base);
-  const v128_t mem_size = wasm_u32x4_splat((uintptr_t)emscripten_get_heap_size() - (uintptr_t)&__heap_base);
-  const v128_t align_mask = wasm_u32x4_const_splat((uintptr_t)7);
+  const v128_t mem_start = wasm_u32x4_splat(managed_min_page * HEAP_INDEX_PAGE_SIZE); // Only values within the bounds of managed memory are tested further.
+  const v128_t mem_size = wasm_u32x4_splat((managed_max_page - managed_min_page) * HEAP_INDEX_PAGE_SIZE);
+  const v128_t align_mask = wasm_u32x4_const_splat((uintptr_t)MARK_PTR_ALIGN_MASK);
   const v128_t zero = wasm_u32x4_const_splat((uintptr_t)0);
+#define CANDIDATE_MASK(v) wasm_v128_and(wasm_u32x4_lt((v), mem_size), wasm_i32x4_eq(wasm_v128_and((v), align_mask), zero))
 
-  for(void **p = (void**)ptr; (uintptr_t)p < (uintptr_t)ptr + bytes; p += 4)
+  void *prev = 0, *batch[2*MARK_BATCH_SIZE]; // An iteration adds at most 16 candidates to a batch that is not yet full.
+  uint32_t num_batched = 0;
+  void **p = (void**)ptr, **end = (void**)((uintptr_t)ptr + bytes);
+  for(; p + 16 <= end; p += 16) // Unrolled: filter four vectors at a time.
+  {
+    v128_t c0 = CANDIDATE_MASK(wasm_i32x4_sub(wasm_v128_load(p), mem_start));
+    v128_t c1 = CANDIDATE_MASK(wasm_i32x4_sub(wasm_v128_load(p+4), mem_start));
+    v128_t c2 = CANDIDATE_MASK(wasm_i32x4_sub(wasm_v128_load(p+8), mem_start));
+    v128_t c3 = CANDIDATE_MASK(wasm_i32x4_sub(wasm_v128_load(p+12), mem_start));
+    if (!wasm_v128_any_true(wasm_v128_or(wasm_v128_or(c0, c1), wasm_v128_or(c2, c3)))) continue;
+    MARK_CANDIDATES(p, c0);
+    MARK_CANDIDATES(p+4, c1);
+    MARK_CANDIDATES(p+8, c2);
+    MARK_CANDIDATES(p+12, c3);
+    if (num_batched >= MARK_BATCH_SIZE) { mark_batch(batch, num_batched); num_batched = 0; }
+  }
+  const v128_t lane_offsets = wasm_u32x4_make(0, sizeof(void*), 2*sizeof(void*), 3*sizeof(void*));
+  for(; p < end; p += 4)
   {
-    v128_t ptrs = wasm_i32x4_sub(wasm_v128_out_of_bounds_load(p), mem_start); // Always aligned load as per managed allocations and std::max_align_t being 16 bytes.
-    v128_t cmp = wasm_v128_and(wasm_u32x4_lt(ptrs, mem_size), wasm_i32x4_eq(wasm_v128_and(ptrs, align_mask), zero));
-    if (wasm_v128_any_true(cmp))
-      for(uint32_t bits = wasm_i32x4_bitmask(cmp), offset; bits; bits ^= 1 << offset)
-        mark_maybe_ptr(p[(offset = __builtin_ctz(bits))]);
+    v128_t cmp = CANDIDATE_MASK(wasm_i32x4_sub(wasm_v128_out_of_bounds_load(p), mem_start)); // Always aligned load as per managed allocations and std::max_align_t being 16 bytes.
+    // Lanes that start at or past the end of the range hold allocator slack or another allocation, so must not be marked.
+    cmp = wasm_v128_and(cmp, wasm_u32x4_lt(lane_offsets, wasm_u32x4_splat((uintptr_t)end - (uintptr_t)p)));
+    if (wasm_v128_any_true(cmp)) MARK_CANDIDATES(p, cmp);
   }
+  mark_batch(batch, num_batched);
+#undef CANDIDATE_MASK
 }
 #else
 static void mark(void *ptr, size_t bytes)
@@ -0,0 +1,85 @@
+// emgc-mark_stack.c keeps marking in constant native stack space. Instead of scanning each newly marked allocation
+// recursively, single-threaded builds push it to an explicit mark stack of EMGC_MARK_STACK_SIZE entries, which the
+// outermost scan drains in a loop. (Multithreaded builds push to the mark deques of emgc-work_stealing.c instead.)
+// If an allocation cannot be pushed because the mark stack is full (or in multithreaded builds, because memory for
+// the overflow segments runs out), the allocation stays marked but unscanned, and mark_overflowed is set. Marking then
+// recovers by rescanning all marked allocations, until a pass completes without overflowing. Each pass marks at least
+// one more level of the object graph, so this converges, but it is slow, so the stack should be large enough for the
+// typical width of the graph.
+
+// Scans all marked non-leaf allocations again, to find the allocations that overflowed marking left unscanned.
+static void mark_rescan()
+{
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  for(uint32_t p = 0; p < num_arena_pages; ++p)
+  {
+    arena_page *page = arena_pages[p];
+    for(uint32_t w = 0, offset; w < ARENA_BITMAP_WORDS; ++w)
+      for(uint64_t b = page->used[w] & page->mark[w] & ~page->leaf[w]; b; b ^= 1ull << offset)
+        scan_item((mark_item){ page->objects + (w*64 + (offset = __builtin_ctzll(b))) * page->obj_size, page->obj_size, 0 });
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  for(uint32_t i = 0; i < los_spans.num; ++i)
+    if (los_spans.spans[i]->mark && !los_spans.spans[i]->leaf) scan_item((mark_item){ los_spans.spans[i]->start, los_spans.spans[i]->bytes, 0 });
+#endif
+  for(uint32_t g = 0; g <= table_mask / TABLE_GROUP_SIZE; ++g)
+    for(uint32_t b = table[g].used & table[g].mark, offset; b; b ^= 1u << offset)
+    {
+      uint32_t i = g*TABLE_GROUP_SIZE + (offset = __builtin_ctz(b));
+      if (!HAS_LEAF_BIT(TABLE_PTR(i))) scan_item((mark_item){ REMOVE_FLAG_BITS(TABLE_PTR(i)), TABLE_SIZE(i), table_type(i) });
+    }
+}
+
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+// Scans the allocations that mark() has queued on this thread. Used to mark more after a collection has finished
+// marking, while no other thread is marking.
+static void mark_drain()
+{
+  for(mark_item item;;)
+  {
+    while(mark_next(&item)) scan_item(item);
+    if (!mark_overflowed) break;
+    mark_overflowed = 0;
+    mark_rescan();
+  }
+}
+#else
+
+#ifndef EMGC_MARK_STACK_SIZE
+#define EMGC_MARK_STACK_SIZE 4096 // Number of allocations that the mark stack can hold.
+#endif
+
+static mark_item *mark_stack; // Allocated from the system allocator, so that it is not scanned as static data.
+static uint32_t mark_stack_size;
+static int mark_stack_draining;
+
+static void mark_stack_push(mark_item item)
+{
+  if (!mark_stack) mark_stack = (mark_item*)malloc(EMGC_MARK_STACK_SIZE*sizeof(mark_item));
+  if (!mark_stack || mark_stack_size == EMGC_MARK_STACK_SIZE)
+  {
+    mark_overflowed = 1; // Leave the allocation unscanned, for mark_recover_overflow() to find.
+    return;
+  }
+  mark_stack[mark_stack_size++] = item;
+  if (mark_stack_draining) return; // An outer call is already draining the stack.
+
+  mark_stack_draining = 1;
+  while(mark_stack_size > 0) scan_item(mark_stack[--mark_stack_size]);
+  mark_stack_draining = 0;
+}
+
+// Completes marking after the mark stack has overflowed. Called once the roots have been marked.
+static void mark_recover_overflow()
+{
+  while(mark_overflowed)
+  {
+    mark_overflowed = 0;
+    mark_rescan();
+  }
+}
+
+static void mark_drain() { mark_recover_overflow(); } // mark() has already scanned everything that it did not overflow.
+
+#endif
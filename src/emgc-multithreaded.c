@@ -27,34 +27,73 @@ static uint32_t cas_u32(_Atomic(uint32_t) *addr, uint32_t prev, uint32_t new) {
 
 static void sweep();
 static void mark_from_queue();
+static void mark_rescan(void);
+static void mark_drain(void);
 static void mark_current_thread_stack();
 static void mark(void *ptr, size_t bytes);
 static void gc_uninterrupted_sleep(double nsecs);
+static void tlab_flush(void);
+#ifdef EMGC_CONCURRENT_MARKING
+static int concurrent_participate(void);
+static void concurrent_begin_locked(void);
+static int concurrent_finish_initial_pause(void);
+static int concurrent_trace(void);
+static void satb_flush(void);
+#endif
 
 static _Atomic(int) num_threads_accessing_managed_state, mt_marking_running, num_threads_ready_to_start_marking, num_threads_finished_marking, num_threads_resumed_execution;
 static __thread int this_thread_accessing_managed_state;
 static __thread uintptr_t stack_top;
-#define MARK_QUEUE_MASK 1023
-static void **mark_queue;
-static _Atomic(uint32_t) producer_head, consumer_head, queue_tail;
+#define MARKING_CLOSED_BIT 0x40000000 // Set in num_threads_ready_to_start_marking once the participants of a collection have been fixed.
+typedef struct mark_item { void *ptr; size_t bytes; gc_type type; } mark_item; // A managed allocation, or a chunk of a large object, to scan.
+static void scan_item(mark_item item);
+static _Atomic(int) mark_overflowed; // Set if an allocation was marked, but could not be queued for scanning, see emgc-mark_stack.c.
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+static void release_mark_deque(void);
+static void gather_root_chunks(void);
+static int mark_root_chunk(void);
+static int root_chunks_pending(void);
+#endif
 
 static void wait_for_all_participants()
 {
   // Wait for all threads currently executing in managed context to gather up together for the collection.
-  while(num_threads_ready_to_start_marking < num_threads_accessing_managed_state) gc_uninterrupted_sleep(1);
+  while(!(num_threads_ready_to_start_marking & MARKING_CLOSED_BIT) && num_threads_ready_to_start_marking < num_threads_accessing_managed_state) gc_uninterrupted_sleep(1);
+}
+
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+// Registers the calling thread as a participant to the current collection. Fails if the collection already
+// started marking without this thread.
+static int join_marking()
+{
+  int ready = num_threads_ready_to_start_marking;
+  while(!(ready & MARKING_CLOSED_BIT))
+    if (__c11_atomic_compare_exchange_strong(&num_threads_ready_to_start_marking, &ready, ready+1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return 1;
+  return 0;
 }
+#endif
 
 // Mark as keepalive to make sure it exists in the generated Module so that the
 // --instrument-cooperative-gc Binaryen pass can find it. (TODO: This function shouldn't be exported out to JS)
 void GC_CHECKPOINT_KEEPALIVE gc_participate_to_garbage_collection()
 {
 #ifdef __EMSCRIPTEN_SHARED_MEMORY__
-  if (mt_marking_running && this_thread_accessing_managed_state)
+  if (!this_thread_accessing_managed_state) return;
+  while(mt_marking_running)
   {
-    ++num_threads_ready_to_start_marking;
-    wait_for_all_participants();
-    mark_current_thread_stack();
-    mark_from_queue();
+    if (join_marking())
+    {
+      wait_for_all_participants();
+#ifdef EMGC_CONCURRENT_MARKING
+      if (concurrent_participate()) return;
+#endif
+      mark_current_thread_stack();
+      mark_from_queue();
+      return;
+    }
+    // This thread entered or returned to the fence after marking had started. Its stack was either empty or orphaned,
+    // so it is not needed in marking, but it must not touch managed state before marking has finished.
+    gc_uninterrupted_sleep(1);
   }
 #endif
 }
@@ -77,7 +116,17 @@ static void gc_enter_fence()
 
 static void gc_exit_fence()
 {
-  if (!--this_thread_accessing_managed_state) --num_threads_accessing_managed_state;
+  if (!--this_thread_accessing_managed_state)
+  {
+    tlab_flush(); // Threads outside the fence don't participate to marking, so they must not keep allocations buffered.
+#ifdef EMGC_CONCURRENT_MARKING
+    satb_flush(); // Nor overwritten pointers.
+#endif
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+    release_mark_deque();
+#endif
+    --num_threads_accessing_managed_state;
+  }
 }
 
 void *js_try_finally(gc_mutator_func func, void *user1, void *user2, void (*finally_func)(void));
@@ -93,25 +142,38 @@ static void gc_wait_for_all_threads_resumed_execution()
   while(num_threads_resumed_execution < num_threads_finished_marking) gc_uninterrupted_sleep(1);
 }
 
-static void start_multithreaded_collection()
+static void start_multithreaded_collection(int minor)
 {
 #ifdef __EMSCRIPTEN_SHARED_MEMORY__
   gc_wait_for_all_threads_resumed_execution();
 
-  producer_head = consumer_head = queue_tail = 0;
   gc_enter_fence();
   num_threads_resumed_execution = num_threads_finished_marking = 0;
-  num_threads_ready_to_start_marking = 1;
+  num_threads_ready_to_start_marking = 0;
   mt_marking_running = 1;
-  wait_for_all_participants();
+  // Gather all other participants first without holding the GC lock, since they may need it to publish their TLABs.
+  while(num_threads_ready_to_start_marking + 1 < num_threads_accessing_managed_state) gc_uninterrupted_sleep(1);
   GC_MALLOC_ACQUIRE();
+  begin_collection_locked(minor);
+  gather_root_chunks();
+#ifdef EMGC_CONCURRENT_MARKING
+  concurrent_begin_locked();
+#endif
+  // Count this thread in only after the lock is held, so that participants won't start marking before the previous
+  // sweep has finished.
+  ++num_threads_ready_to_start_marking;
+  wait_for_all_participants();
+  // Threads that enter or return to the fence from now on will wait for marking to finish, instead of joining late.
+  num_threads_ready_to_start_marking |= MARKING_CLOSED_BIT;
+#else
+  begin_collection_locked(minor);
 #endif
 }
 
 static void wait_for_all_threads_finished_marking()
 {
   ++num_threads_finished_marking;
-  while(mt_marking_running && num_threads_finished_marking < num_threads_ready_to_start_marking) gc_uninterrupted_sleep(1);
+  while(mt_marking_running && num_threads_finished_marking < (num_threads_ready_to_start_marking & ~MARKING_CLOSED_BIT)) gc_uninterrupted_sleep(1);
   ++num_threads_resumed_execution;
 }
 
@@ -137,6 +199,9 @@ static _Atomic(int) sweep_worker_running, sweep_worker_should_quit;
 static void finish_multithreaded_marking()
 {
 #ifdef __EMSCRIPTEN_SHARED_MEMORY__
+#ifdef EMGC_CONCURRENT_MARKING
+  if (concurrent_finish_initial_pause()) return;
+#endif
   mark_from_queue();
   mt_marking_running = 0;
   gc_exit_fence();
@@ -154,8 +219,10 @@ static void finish_multithreaded_marking()
 #ifdef __EMSCRIPTEN_SHARED_MEMORY__
 
 // N.b. this stack only needs to contain LLVM data stack. Wasm VM stack is separate,
-// so this stack can be much smaller.
-static char sweep_worker_stack[2048];
+// so this stack can be much smaller. It still needs to fit the batches of dead allocations that sweep_partitions()
+// gathers (SWEEP_BATCH_SIZE table indices and pointers) and the qsort() and dlbulk_free() calls on them.
+#define SWEEP_STACK_SIZE 16384
+static char sweep_worker_stack[SWEEP_STACK_SIZE];
 static emscripten_wasm_worker_t sweep_worker;
 
 static void sweep_worker_main()
@@ -165,6 +232,9 @@ static void sweep_worker_main()
   {
     emscripten_semaphore_waitinf_acquire(&sweep_command, 1);
     if (sweep_worker_should_quit) break;
+#ifdef EMGC_CONCURRENT_MARKING
+    if (concurrent_trace()) continue;
+#endif
     sweep();
   }
   sweep_worker_running = 0;
@@ -172,8 +242,6 @@ static void sweep_worker_main()
 
 __attribute__((constructor(40))) static void initialize_multithreaded_gc()
 {
-  mark_queue = (void**)malloc((MARK_QUEUE_MASK+1)*sizeof(void*));
-  assert(mark_queue);
   sweep_worker = emscripten_create_wasm_worker(sweep_worker_stack, sizeof(sweep_worker_stack));
   emscripten_wasm_worker_post_function_v(sweep_worker, sweep_worker_main);
 }
@@ -0,0 +1,51 @@
+// emgc-pacing.c implements automatic collection pacing. The collector counts the bytes that are allocated after each
+// collection, and once they exceed growth_factor times the bytes that survived the previous collection, it either
+// collects right away (GC_PACING_SYNC), or schedules a collection to the event loop (GC_PACING_WHEN_STACK_IS_EMPTY).
+// Pacing is disabled by default, enable it with gc_set_pacing().
+
+#ifndef EMGC_PACING_MIN_BYTES
+#define EMGC_PACING_MIN_BYTES (1024*1024) // Pacing lets at least this many bytes be allocated between collections, even if the live set is smaller.
+#endif
+
+static size_t managed_bytes, bytes_allocated_since_collect, live_bytes_after_collect;
+static int pacing_mode = GC_PACING_OFF;
+static double pacing_growth_factor = 1.0;
+static volatile uint8_t pacing_collection_pending; // Set when pacing has triggered a collection that has not started yet.
+
+static void pacing_count_malloc(size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  managed_bytes += bytes;
+  bytes_allocated_since_collect += bytes;
+}
+
+static void pacing_count_free(size_t bytes)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  assert(managed_bytes >= bytes);
+  managed_bytes -= bytes;
+}
+
+void gc_set_pacing(int mode, double growth_factor)
+{
+  assert(mode == GC_PACING_OFF || mode == GC_PACING_SYNC || mode == GC_PACING_WHEN_STACK_IS_EMPTY);
+  assert(growth_factor > 0);
+  pacing_mode = mode;
+  pacing_growth_factor = growth_factor;
+}
+
+int64_t gc_collection_debt()
+{
+  size_t live = (live_bytes_after_collect > EMGC_PACING_MIN_BYTES) ? live_bytes_after_collect : EMGC_PACING_MIN_BYTES;
+  return (int64_t)bytes_allocated_since_collect - (int64_t)(pacing_growth_factor * live);
+}
+
+// Called at the start of each allocation function, before the new allocation exists, so that a synchronous
+// collection cannot free it.
+static void gc_pace()
+{
+  if (pacing_mode == GC_PACING_OFF || pacing_collection_pending || gc_collection_debt() < 0) return;
+  if (__sync_lock_test_and_set(&pacing_collection_pending, 1)) return; // Another thread already triggered the collection.
+  if (pacing_mode == GC_PACING_SYNC) gc_collect();
+  else gc_collect_when_stack_is_empty();
+}
@@ -0,0 +1,77 @@
+// emgc-parallel_roots.c splits the root set of multithreaded collections between all threads that participate to
+// marking. At the start of a collection, the collecting thread records the static data section, the custom root blocks,
+// the orphaned stacks and the roots table as a list of chunks of at most ROOT_CHUNK_SIZE bytes, and the marking threads
+// then claim chunks from the list with an atomic counter, before they start tracing. (Each thread still scans its own
+// stack itself.) The locks of the root tables are held from the time the list is made until its last chunk has been
+// scanned, so that the tables cannot be resized or freed while other threads scan them.
+
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+
+#define ROOT_CHUNK_SIZE 16384 // Granularity at which marking threads share the scanning of root regions.
+
+static range *root_chunks; // Allocated from the system allocator, so that it is not scanned as static data.
+static uint32_t num_root_chunks, root_chunks_cap;
+static _Atomic(uint32_t) next_root_chunk, num_root_chunks_scanned;
+
+static void release_root_locks()
+{
+  gc_release_lock(&orphan_stack_lock);
+  gc_release_lock(&custom_roots_lock);
+  gc_release_lock(&roots_lock);
+}
+
+// Appends the given memory region to the list of root chunks. Returns 0 if out of memory.
+static int add_root_region(void *start, void *end)
+{
+  for(char *p = (char*)start; p < (char*)end; p += ROOT_CHUNK_SIZE)
+  {
+    if (num_root_chunks == root_chunks_cap)
+    {
+      range *new_chunks = (range*)realloc(root_chunks, ((root_chunks_cap*2 + 1)|31)*sizeof(range));
+      if (!new_chunks) return 0;
+      root_chunks = new_chunks;
+      root_chunks_cap = (root_chunks_cap*2 + 1)|31;
+    }
+    root_chunks[num_root_chunks++] = (range){ p, ((char*)end - p > ROOT_CHUNK_SIZE) ? p + ROOT_CHUNK_SIZE : end };
+  }
+  return 1;
+}
+
+// Records the root chunks of a collection. Called on the collecting thread with the GC lock held, before the other
+// participants are let to start marking. If this runs out of memory, no chunks are recorded, and mark_roots() scans
+// the roots on the collecting thread instead.
+static void gather_root_chunks()
+{
+  num_root_chunks = num_root_chunks_scanned = next_root_chunk = 0;
+  gc_acquire_lock(&roots_lock);
+  gc_acquire_lock(&custom_roots_lock);
+  gc_acquire_lock(&orphan_stack_lock);
+  int ok = 1;
+#ifndef EMGC_SKIP_AUTOMATIC_STATIC_MARKING
+  ok = add_root_region(STATIC_ROOTS_START, STATIC_ROOTS_END);
+#endif
+  if (custom_roots)
+    for(uint32_t i = 0; ok && i <= custom_roots_mask; ++i)
+      ok = add_root_region(custom_roots[i].start, custom_roots[i].end);
+  for(range *r = orphan_stacks; ok && r < orphan_stacks + orphan_stack_size; ++r)
+    ok = add_root_region(r->start, r->end);
+  if (ok && roots) ok = add_root_region(roots, roots + roots_mask + 1);
+
+  if (!ok) num_root_chunks = 0;
+  if (!num_root_chunks) release_root_locks();
+}
+
+// Claims and scans the next root chunk. Returns 0 if all chunks have been claimed.
+static int mark_root_chunk()
+{
+  if (next_root_chunk >= num_root_chunks) return 0;
+  uint32_t i = next_root_chunk++;
+  if (i >= num_root_chunks) return 0;
+  mark(root_chunks[i].start, (uintptr_t)root_chunks[i].end - (uintptr_t)root_chunks[i].start);
+  if (++num_root_chunks_scanned == num_root_chunks) release_root_locks(); // The last chunk is done, so the root tables may change again.
+  return 1;
+}
+
+static int root_chunks_pending() { return next_root_chunk < num_root_chunks; }
+
+#endif
@@ -0,0 +1,113 @@
+// emgc-parallel_sweep.c sweeps the managed allocation table. The table is divided into partitions of
+// SWEEP_PARTITION_GROUPS groups, which the sweeping threads claim with an atomic counter. A thread gathers the dead
+// allocations that it finds into batches. It detaches each batch from the tables that the whole heap shares (weak
+// pointers, types and the heap index) while holding sweep_lock, and then clears their table slots without holding
+// any lock, since no other thread touches the groups of its partition. The batch is then handed to the allocator in a
+// single dlbulk_free() call, in address order, so that dlmalloc takes its lock once per batch and merges the chunks
+// of neighbouring dead allocations as it goes.
+// In multithreaded builds, the thread that sweeps (the sweep worker, or the collecting thread if the sweep worker has
+// not started up yet) is helped by EMGC_NUM_SWEEP_WORKERS-1 sweep helper workers, which wait on a semaphore between sweeps.
+
+#ifndef EMGC_NUM_SWEEP_WORKERS
+#define EMGC_NUM_SWEEP_WORKERS 1 // Number of threads that sweep the allocation table in multithreaded builds, including the sweep worker.
+#endif
+#define SWEEP_PARTITION_GROUPS 1024 // Number of table groups that a sweeping thread claims at a time.
+#define SWEEP_BATCH_SIZE 64 // Number of dead allocations that a sweeping thread detaches from the shared tables at a time.
+
+static emscripten_lock_t sweep_lock = EMSCRIPTEN_LOCK_T_STATIC_INITIALIZER;
+static _Atomic(uint32_t) next_sweep_partition;
+static uint32_t num_sweep_partitions;
+
+static int compare_ptrs(const void *a, const void *b)
+{
+  uintptr_t x = (uintptr_t)*(void*const*)a, y = (uintptr_t)*(void*const*)b;
+  return (x > y) - (x < y);
+}
+
+// Frees a batch of dead allocations, given by their table indices.
+static void sweep_batch(const uint32_t *dead, uint32_t n)
+{
+  void *ptrs[SWEEP_BATCH_SIZE];
+  gc_acquire_lock(&sweep_lock);
+  for(uint32_t i = 0; i < n; ++i) ptrs[i] = table_release(dead[i]);
+  gc_release_lock(&sweep_lock);
+
+  size_t bytes = 0;
+  uint32_t num_emptied = 0;
+  for(uint32_t i = 0; i < n; ++i)
+  {
+    bytes += malloc_usable_size(ptrs[i]);
+    num_emptied += table_clear_slot(dead[i]);
+  }
+  qsort(ptrs, n, sizeof(void*), compare_ptrs);
+  dlbulk_free(ptrs, n);
+
+  gc_acquire_lock(&sweep_lock);
+  pacing_count_free(bytes);
+  num_allocs -= n;
+  num_table_entries -= num_emptied;
+  gc_release_lock(&sweep_lock);
+}
+
+// Claims and sweeps table partitions until none are left.
+static void sweep_partitions()
+{
+  uint32_t dead[SWEEP_BATCH_SIZE], n = 0, num_groups = table_mask / TABLE_GROUP_SIZE + 1;
+  for(uint32_t p; (p = next_sweep_partition++) < num_sweep_partitions;)
+  {
+    uint32_t end = (p+1)*SWEEP_PARTITION_GROUPS < num_groups ? (p+1)*SWEEP_PARTITION_GROUPS : num_groups;
+    for(uint32_t g = p*SWEEP_PARTITION_GROUPS; g < end; ++g)
+      for(uint32_t b = table[g].used & ~(uint32_t)table[g].mark, offset; b; b ^= 1u << offset)
+      {
+        dead[n++] = g*TABLE_GROUP_SIZE + (offset = __builtin_ctz(b));
+        if (n == SWEEP_BATCH_SIZE)
+        {
+          sweep_batch(dead, n);
+          n = 0;
+        }
+      }
+  }
+  if (n) sweep_batch(dead, n);
+}
+
+#if defined(__EMSCRIPTEN_SHARED_MEMORY__) && EMGC_NUM_SWEEP_WORKERS > 1
+static emscripten_semaphore_t sweep_helper_command = EMSCRIPTEN_SEMAPHORE_T_STATIC_INITIALIZER(0);
+static _Atomic(int) num_sweep_helpers_running, num_sweep_helpers_finished;
+static char sweep_helper_stacks[EMGC_NUM_SWEEP_WORKERS-1][SWEEP_STACK_SIZE]; // Sized like the stack of the sweep worker, since both run sweep_partitions().
+
+static void sweep_helper_main()
+{
+  ++num_sweep_helpers_running;
+  for(;;)
+  {
+    emscripten_semaphore_waitinf_acquire(&sweep_helper_command, 1);
+    sweep_partitions();
+    ++num_sweep_helpers_finished;
+  }
+}
+
+__attribute__((constructor(40))) static void initialize_sweep_helpers()
+{
+  for(int i = 0; i < EMGC_NUM_SWEEP_WORKERS-1; ++i)
+    emscripten_wasm_worker_post_function_v(emscripten_create_wasm_worker(sweep_helper_stacks[i], sizeof(sweep_helper_stacks[i])), sweep_helper_main);
+}
+#endif
+
+// Frees all unmarked allocations of the table. Called with the GC lock held.
+static void sweep_table()
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  num_sweep_partitions = (table_mask / TABLE_GROUP_SIZE) / SWEEP_PARTITION_GROUPS + 1;
+  next_sweep_partition = 0;
+#if defined(__EMSCRIPTEN_SHARED_MEMORY__) && EMGC_NUM_SWEEP_WORKERS > 1
+  // Wake up the helpers that have started up, and wait until each wakeup has been handled, so that no helper is left
+  // sweeping after this returns.
+  int num_helpers = (num_sweep_partitions > 1) ? num_sweep_helpers_running : 0;
+  num_sweep_helpers_finished = 0;
+  if (num_helpers) emscripten_semaphore_release(&sweep_helper_command, num_helpers);
+  sweep_partitions();
+  while(num_sweep_helpers_finished < num_helpers) gc_uninterrupted_sleep(1);
+#else
+  sweep_partitions();
+#endif
+}
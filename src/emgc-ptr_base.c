@@ -1,25 +1,30 @@
 // emgc-ptr_base.c deals with converting interior pointers that point somewhere
 // inside an allocated buffer, into a pointer that points to the base address
-// of the allocation.
+// of the allocation. This is a constant time lookup to the heap index (see emgc-heap_index.c)
 
 void *gc_ptr_base(void *ptr)
 {
   if ((uintptr_t)ptr - (uintptr_t)&__heap_base >= (uintptr_t)emscripten_get_heap_size() - (uintptr_t)&__heap_base) return 0;
-  if (!num_allocs) return 0;
-
-  // This is intentionally a O(n) scan over the whole managed alloc table for now.
-  // TODO: Rewrite this to utilize an allocation range interval tree for performance.
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    GC_MALLOC_ACQUIRE();
+    uint32_t i = arena_object_index_containing(page, ptr);
+    GC_MALLOC_RELEASE();
+    return (i != INVALID_INDEX) ? page->objects + i * page->obj_size : 0;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  GC_MALLOC_ACQUIRE();
+  los_span *span = los_span_containing(ptr);
+  GC_MALLOC_RELEASE();
+  if (span) return span->start;
+#endif
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
-  for(uint32_t i = 0, offset; i <= table_mask; i += 64)
-    for(uint64_t bits = ((uint64_t*)used_table)[i>>6]; bits; bits ^= (1ull<<offset))
-    {
-      void *managed_ptr = REMOVE_FLAG_BITS(table[i + (offset = __builtin_ctzll(bits))]);
-      if (ptr >= managed_ptr && (uintptr_t)ptr - (uintptr_t)managed_ptr < malloc_usable_size(managed_ptr))
-      {
-        GC_MALLOC_RELEASE();
-        return managed_ptr;
-      }
-    }
+  uint32_t i = heap_index_find(ptr);
+  void *base = (i != INVALID_INDEX) ? REMOVE_FLAG_BITS(TABLE_PTR(i)) : 0;
   GC_MALLOC_RELEASE();
-  return 0;
+  return base;
 }
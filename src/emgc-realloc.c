@@ -0,0 +1,136 @@
+// emgc-realloc.c implements gc_realloc(). Allocations are resized in place whenever the underlying allocator allows it,
+// in which case they keep their allocation table slot and all of their metadata. Otherwise the contents are moved to a
+// new allocation, and the root, leaf, finalizer, weak pointer status and type of the old allocation are rehomed to the new
+// allocation under the same GC lock acquisition in which the old allocation is freed.
+
+// Resizes the given malloc()ed allocation in place with the allocator that is linked in. Returns 0 if it cannot.
+static void *realloc_in_place(void *ptr, size_t bytes)
+{
+  if (dlrealloc_in_place) return dlrealloc_in_place(ptr, bytes);
+  if (emmalloc_realloc_try) return emmalloc_realloc_try(ptr, bytes);
+  return (bytes <= malloc_usable_size(ptr)) ? ptr : 0;
+}
+
+// If gc_realloc() moves an allocation of the given new size and type to a new malloc()ed allocation (rather than to the
+// arena or the large object space), makes it into *dst. The GC lock is released for the malloc() call, like gc_malloc()
+// does, so the caller must look up the metadata of the old allocation again afterwards. Returns 0 if out of memory.
+static int realloc_reserve_locked(size_t bytes, gc_type type, void **dst)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  *dst = 0;
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  if (bytes <= ARENA_MAX_SIZE && !type) return 1; // Typed allocations stay in the allocation table.
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  if (bytes >= EMGC_LARGE_OBJECT_THRESHOLD && !type) return 1;
+#endif
+  GC_MALLOC_RELEASE();
+  *dst = malloc(bytes);
+  GC_MALLOC_ACQUIRE();
+  return *dst != 0;
+}
+
+// Moves the contents and metadata of ptr over to dst, the allocation made by realloc_reserve_locked(), or if that is
+// null, to a new allocation from the arena or the large object space. Caller must free ptr afterwards.
+static void *realloc_move_locked(void *ptr, void *dst, size_t old_size, size_t bytes, int leaf, int finalizer, gc_type type)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  void *new_ptr = dst;
+  if (new_ptr) record_typed_gc_malloc((void*)((uintptr_t)new_ptr | (leaf ? PTR_LEAF_BIT : 0) | (finalizer ? PTR_FINALIZER_BIT : 0)), bytes, type);
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  else if (bytes <= ARENA_MAX_SIZE)
+  {
+    if (!(new_ptr = arena_malloc_locked(bytes))) return 0;
+    arena_page *page = arena_page_of(new_ptr);
+    uint32_t i = arena_object_index(page, new_ptr);
+    arena_set_flag(page->leaf, i, leaf);
+    arena_set_flag(page->finalizer, i, finalizer);
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  else
+  {
+    if (!(new_ptr = los_malloc_locked(bytes))) return 0;
+    los_span *span = los_span_of(new_ptr);
+    span->leaf = !!leaf;
+    span->finalizer = !!finalizer;
+  }
+#endif
+  memcpy(new_ptr, ptr, (old_size < bytes) ? old_size : bytes);
+  // An incremental collection that is marking created the new allocation marked, so it would not scan the copied pointers.
+  if (incremental_phase == INCREMENTAL_MARKING && !leaf) scan_object(new_ptr, (old_size < bytes) ? old_size : bytes, type);
+  move_root(ptr, new_ptr);
+  move_finalizer(ptr, new_ptr);
+  move_weak_ptr(ptr, new_ptr);
+  return new_ptr;
+}
+
+void *gc_realloc(void *ptr, size_t bytes)
+{
+  if (!ptr) return gc_malloc(bytes);
+  if (!bytes)
+  {
+    gc_free(ptr);
+    return 0;
+  }
+  ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  gc_pace();
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  void *new_ptr, *dst;
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    uint32_t i = arena_object_index(page, ptr);
+    assert(i != INVALID_INDEX);
+    if (bytes <= page->obj_size) new_ptr = ptr; // The new size still fits in the size class of the object.
+    else if (realloc_reserve_locked(bytes, 0, &dst) && (new_ptr = realloc_move_locked(ptr, dst, page->obj_size, bytes, BITVEC_GET((uint8_t*)page->leaf, i), BITVEC_GET((uint8_t*)page->finalizer, i), 0)))
+      arena_free(page, i);
+    else new_ptr = 0;
+    GC_MALLOC_RELEASE();
+    return new_ptr;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_of(ptr);
+  if (span)
+  {
+    size_t old_size = span->bytes;
+    if (los_resize_in_place(span, bytes)) new_ptr = ptr;
+    else if (realloc_reserve_locked(bytes, 0, &dst) && (new_ptr = realloc_move_locked(ptr, dst, old_size, bytes, span->leaf, span->finalizer, 0)))
+      los_free(span);
+    else new_ptr = 0;
+    GC_MALLOC_RELEASE();
+    return new_ptr;
+  }
+#endif
+  uint32_t i = table_find(ptr);
+  assert(i != INVALID_INDEX);
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  int in_place = (bytes < EMGC_LARGE_OBJECT_THRESHOLD || TABLE_IS_TYPED(i)); // Untyped allocations that grow past the threshold are moved to the large object space.
+#else
+  int in_place = 1;
+#endif
+  assert(!HAS_WEAK_BIT(TABLE_PTR(i))); // Weak pointer reference blocks cannot be reallocated.
+  size_t old_size = TABLE_SIZE(i), old_usable_size = malloc_usable_size(ptr);
+  if (in_place && realloc_in_place(ptr, bytes)) // Resized in place, so the table slot and all metadata stay as is.
+  {
+    size_t usable_size = malloc_usable_size(ptr);
+    heap_index_remove(ptr, old_size);
+    heap_index_insert(ptr, bytes);
+    TABLE_SIZE(i) = (uint32_t)bytes;
+    if (usable_size > old_usable_size) pacing_count_malloc(usable_size - old_usable_size);
+    else pacing_count_free(old_usable_size - usable_size);
+    new_ptr = ptr;
+  }
+  else if (realloc_reserve_locked(bytes, table_type(i), &dst))
+  {
+    i = table_find(ptr); // Look up the slot again, since the table may have been resized while the GC lock was released.
+    if ((new_ptr = realloc_move_locked(ptr, dst, old_size, bytes, HAS_LEAF_BIT(TABLE_PTR(i)), HAS_FINALIZER_BIT(TABLE_PTR(i)), table_type(i))))
+      table_free(table_find(ptr)); // Look up the slot again, since inserting the new allocation may have resized the table.
+  }
+  else new_ptr = 0;
+  GC_MALLOC_RELEASE();
+  return new_ptr;
+}
@@ -11,12 +11,12 @@ static void insert_root(void *ptr __attribute__((nonnull)))
 {
   assert(ptr);
   uint32_t i = hash_root(ptr);
-  while((uintptr_t)roots[i] > 1)
+  while(roots[i])
   {
     if (roots[i] == ptr) return; // This pointer was already recorded as a root, so no-op.
     i = (i+1) & roots_mask;
   }
-  if ((uintptr_t)roots[i] == 0) ++num_roots_slots_populated;
+  ++num_roots_slots_populated;
   roots[i] = ptr;
 }
 
@@ -36,61 +36,136 @@ int gc_is_root(void *ptr)
   return is_root;
 }
 
-void gc_make_root(void *ptr __attribute__((nonnull)))
+// Rehashes the roots table to the given size. Caller must hold roots_lock.
+static void resize_roots(uint32_t new_mask)
 {
-  assert(ptr);
-  assert(gc_is_ptr(ptr));
-  gc_acquire_lock(&roots_lock);
   uint32_t old_mask = roots_mask;
-  if (2*num_roots_slots_populated >= roots_mask)
+  void **old_roots = roots;
+  roots_mask = new_mask;
+  roots = (void**)calloc(roots_mask+1, sizeof(void*));
+  assert(roots);
+  num_roots_slots_populated = 0;
+  if (old_roots)
   {
-    roots_mask = (roots_mask << 1) | 1;
+    for(uint32_t i = 0; i <= old_mask; ++i)
+      if (old_roots[i]) insert_root(old_roots[i]);
+    free(old_roots);
+  }
+}
 
-    void **old_roots = roots;
-    roots = (void**)calloc(roots_mask+1, sizeof(void*));
-    assert(roots);
-    num_roots_slots_populated = 0;
-    if (old_roots)
+// Grows the roots table if needed, so that one more root can be inserted. Caller must hold roots_lock.
+static void reserve_root()
+{
+  if (2*num_roots_slots_populated >= roots_mask) resize_roots((roots_mask << 1) | 1);
+}
+
+// Removes the root in slot i by shifting the following entries of its probe run backwards, so that no deleted markers
+// are left behind. Then shrinks the table if it has become overly sparse. Caller must hold roots_lock.
+static void erase_root(uint32_t i)
+{
+  for(uint32_t j = (i+1) & roots_mask; roots[j]; j = (j+1) & roots_mask)
+    if (((j - hash_root(roots[j])) & roots_mask) >= ((j - i) & roots_mask)) // Can the entry in slot j move back to slot i?
     {
-      for(uint32_t i = 0; i <= old_mask; ++i)
-        if ((uintptr_t)old_roots[i] > 1) insert_root(old_roots[i]);
-      free(old_roots);
+      roots[i] = roots[j];
+      i = j;
     }
-  }
+  roots[i] = 0;
+  --num_roots_slots_populated;
+  if (8*num_roots_slots_populated < roots_mask && roots_mask > AUX_TABLE_MIN_MASK) resize_roots(roots_mask >> 1);
+}
+
+// Like gc_make_root(), but may be called while holding the GC lock.
+static void make_root(void *ptr)
+{
+  gc_acquire_lock(&roots_lock);
+  reserve_root();
   insert_root(ptr);
   gc_release_lock(&roots_lock);
 }
 
-void gc_unmake_root(void *ptr __attribute__((nonnull)))
+void gc_make_root(void *ptr __attribute__((nonnull)))
 {
-  if (!roots) return;
   assert(ptr);
   assert(gc_is_ptr(ptr));
+  make_root(ptr);
+}
+
+// Removes ptr from the roots table, if it is there. Caller must hold roots_lock.
+static void remove_root(void *ptr)
+{
+  for(uint32_t i = hash_root(ptr); roots[i]; i = (i+1) & roots_mask)
+    if (roots[i] == ptr)
+    {
+      erase_root(i);
+      break;
+    }
+}
+
+// If ptr is a root, makes new_ptr a root in its place. May be called while holding the GC lock.
+static void move_root(void *ptr, void *new_ptr)
+{
+  if (!roots) return;
   gc_acquire_lock(&roots_lock);
   for(uint32_t i = hash_root(ptr); roots[i]; i = (i+1) & roots_mask)
     if (roots[i] == ptr)
     {
-      roots[i] = (void*)1;
+      erase_root(i);
+      reserve_root();
+      insert_root(new_ptr);
       break;
     }
   gc_release_lock(&roots_lock);
 }
 
+// Like gc_unmake_root(), but may be called while holding the GC lock.
+static void unmake_root(void *ptr)
+{
+  if (!roots) return;
+  gc_acquire_lock(&roots_lock);
+  remove_root(ptr);
+  gc_release_lock(&roots_lock);
+}
+
+void gc_unmake_root(void *ptr __attribute__((nonnull)))
+{
+  assert(ptr);
+  assert(gc_is_ptr(ptr));
+  unmake_root(ptr);
+}
+
 void *gc_malloc_root(size_t bytes)
 {
-  void *ptr = gc_malloc(bytes);
-  if (ptr) gc_make_root(ptr);
-  return ptr;
+  void *ptr;
+  return gc_malloc_batch(bytes, 1, GC_FLAG_ROOT, 0, &ptr) ? ptr : 0; // Allocates and flags the pointer with a single lock acquisition.
 }
 
 void gc_make_leaf(void *ptr __attribute__((nonnull)))
 {
   assert(ptr);
   assert(gc_is_ptr(ptr));
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    arena_set_flag(page->leaf, arena_object_index(page, ptr), 1);
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_of(ptr);
+  if (span)
+  {
+    span->leaf = 1;
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
   uint32_t i = table_find(ptr);
   assert(i != INVALID_INDEX);
-  table[i] = (void*)((uintptr_t)table[i] | PTR_LEAF_BIT);
+  TABLE_PTR(i) = (void*)((uintptr_t)TABLE_PTR(i) | PTR_LEAF_BIT);
   GC_MALLOC_RELEASE();
 }
 
@@ -98,18 +173,36 @@ void gc_unmake_leaf(void *ptr __attribute__((nonnull)))
 {
   assert(ptr);
   assert(gc_is_ptr(ptr));
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    arena_set_flag(page->leaf, arena_object_index(page, ptr), 0);
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_of(ptr);
+  if (span)
+  {
+    span->leaf = 0;
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
   uint32_t i = table_find(ptr);
   assert(i != INVALID_INDEX);
-  table[i] = (void*)((uintptr_t)table[i] & ~PTR_LEAF_BIT);
+  TABLE_PTR(i) = (void*)((uintptr_t)TABLE_PTR(i) & ~PTR_LEAF_BIT);
   GC_MALLOC_RELEASE();
 }
 
 void *gc_malloc_leaf(size_t bytes)
 {
-  void *ptr = gc_malloc(bytes);
-  if (ptr) gc_make_leaf(ptr);
-  return ptr;
+  void *ptr;
+  return gc_malloc_batch(bytes, 1, GC_FLAG_LEAF, 0, &ptr) ? ptr : 0; // Allocates and flags the pointer with a single lock acquisition.
 }
 
 int debug_gc_num_roots_slots_populated()
@@ -22,6 +22,10 @@ void gc_temporarily_leave_fence()
 #ifdef __EMSCRIPTEN_SHARED_MEMORY__
   if (!this_thread_accessing_managed_state) return;
 
+  tlab_flush();
+#ifdef EMGC_CONCURRENT_MARKING
+  satb_flush();
+#endif
   gc_acquire_lock(&orphan_stack_lock);
   int i = 0;
   while(i < orphan_stack_size && orphan_stacks[i].start != 0)
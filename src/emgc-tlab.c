@@ -0,0 +1,60 @@
+// emgc-tlab.c implements thread-local allocation buffers (TLABs) for multithreaded builds.
+// Instead of acquiring the global GC lock on every gc_malloc() to insert a single pointer into the allocation table,
+// each thread records its new allocations into a small thread-local buffer, and publishes them to the table in one
+// batch under a single lock acquisition when the buffer fills up.
+// The buffer of a thread is also published
+//  - when the thread leaves the fence (permanently, or temporarily to sleep/wait),
+//  - at the start of gc_collect() on the collecting thread, and
+//  - before the thread looks up the allocation table (gc_is_ptr(), gc_free(), gc_make_leaf() etc.)
+// so a thread always observes its own allocations. Allocations that another thread still holds in its buffer are
+// not yet visible to the current thread.
+// When a thread participates to a garbage collection, the GC lock is held by the collecting thread, so the buffer
+// cannot be published. Instead the participating thread marks the contents of its buffered allocations as roots.
+// Buffered allocations are not in the allocation table, so they cannot be freed by the sweep.
+
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+
+#ifndef EMGC_TLAB_SIZE
+#define EMGC_TLAB_SIZE 64 // Number of allocations each thread can buffer before publishing them to the allocation table.
+#endif
+
+static __thread void *tlab[EMGC_TLAB_SIZE];
+static __thread uint32_t tlab_sizes[EMGC_TLAB_SIZE]; // Requested sizes of the buffered allocations.
+static __thread uint32_t tlab_count;
+
+static void tlab_publish_locked()
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  for(uint32_t i = 0; i < tlab_count; ++i)
+  {
+    record_gc_malloc(tlab[i], tlab_sizes[i]);
+    // Another thread may have taken a weak pointer to the allocation while it was buffered, so flag its table slot.
+    table_set_has_weak(REMOVE_FLAG_BITS(tlab[i]));
+  }
+  tlab_count = 0;
+}
+
+static void tlab_flush()
+{
+  if (!tlab_count) return;
+  GC_MALLOC_ACQUIRE();
+  tlab_publish_locked();
+  GC_MALLOC_RELEASE();
+}
+
+// Marks the contents of this thread's buffered allocations, since marking cannot find them in the allocation table.
+static void tlab_mark()
+{
+  for(uint32_t i = 0; i < tlab_count; ++i) mark(tlab[i], tlab_sizes[i]);
+}
+
+static void tlab_record_gc_malloc(void *ptr, size_t bytes)
+{
+  tlab_sizes[tlab_count] = (uint32_t)bytes;
+  tlab[tlab_count++] = ptr;
+  if (tlab_count == EMGC_TLAB_SIZE) tlab_flush();
+}
+
+#else
+static void tlab_flush() {} // Singlethreaded builds don't need to take a lock to allocate, so record allocations directly.
+#endif
@@ -0,0 +1,215 @@
+// emgc-typed.c implements typed allocations (gc_malloc_typed()). By default marking scans every word of a non-leaf
+// allocation for pointers. A type tells marking precisely where the pointers of an allocation are: either with a
+// bitmap of the pointer-sized words that hold pointers (optionally repeating over the allocation, for arrays of
+// structs), or with a trace callback that visits the pointers of the allocation itself. This cuts the scanning work of
+// allocations that mostly hold data, and avoids data words that happen to look like pointers retaining garbage.
+// Registered types are kept in the types array, and indexed with gc_type handles. Type 0 means no type.
+// Typed allocations are always recorded in the allocation table, where the typed bit of the table slot tells marking
+// to look up the type of the allocation from a separate hash table.
+
+typedef struct type_info
+{
+  gc_trace_func trace; // If not null, marking calls this to find the pointers of the allocation, and bitmap is unused.
+  uint32_t *bitmap; // Bit i is set if word i of the layout holds a pointer.
+  uint32_t num_words; // Number of words in the layout.
+  int repeat; // If nonzero, the layout repeats every num_words words until the end of the allocation.
+} type_info;
+
+static type_info *types;
+static uint32_t num_types = 1; // types[0] is reserved for "no type".
+
+typedef struct type_map
+{
+  void *ptr;
+  gc_type type;
+} type_map;
+
+static type_map *typed_allocs;
+static uint32_t num_typed_allocs, typed_allocs_mask;
+
+static uint32_t hash_type(void *ptr) { return (uint32_t)((uintptr_t)ptr >> 3) & typed_allocs_mask; }
+
+static uint32_t find_type_index(void *ptr)
+{
+  if (typed_allocs)
+    for(uint32_t i = hash_type(ptr); typed_allocs[i].ptr; i = (i+1) & typed_allocs_mask)
+      if (typed_allocs[i].ptr == ptr) return i;
+  return INVALID_INDEX;
+}
+
+static void insert_type(void *ptr, gc_type type)
+{
+  uint32_t i = hash_type(ptr);
+  while(typed_allocs[i].ptr && typed_allocs[i].ptr != ptr)
+    i = (i+1) & typed_allocs_mask;
+
+  if (typed_allocs[i].ptr != ptr)
+  {
+    ++num_typed_allocs;
+    typed_allocs[i].ptr = ptr;
+  }
+  typed_allocs[i].type = type;
+}
+
+// Rehashes the typed allocations table to the given size.
+static void resize_typed_allocs(uint32_t new_mask)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t old_mask = typed_allocs_mask;
+  type_map *old_typed_allocs = typed_allocs;
+  typed_allocs_mask = new_mask;
+  typed_allocs = (type_map*)calloc(typed_allocs_mask+1, sizeof(type_map));
+  assert(typed_allocs);
+  num_typed_allocs = 0; // insert_type() will recalculate the number of typed allocations.
+
+  if (old_typed_allocs)
+  {
+    for(uint32_t i = 0; i <= old_mask; ++i)
+      if (old_typed_allocs[i].ptr)
+        insert_type(old_typed_allocs[i].ptr, old_typed_allocs[i].type);
+    free(old_typed_allocs);
+  }
+}
+
+// Removes the type of the given allocation with backward shift deletion, and shrinks the table if it has become overly
+// sparse. Caller is responsible for clearing the typed bit of the allocation.
+static void remove_type(void *ptr)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t i = find_type_index(ptr);
+  if (i == INVALID_INDEX) return;
+  for(uint32_t j = (i+1) & typed_allocs_mask; typed_allocs[j].ptr; j = (j+1) & typed_allocs_mask)
+    if (((j - hash_type(typed_allocs[j].ptr)) & typed_allocs_mask) >= ((j - i) & typed_allocs_mask))
+    {
+      typed_allocs[i] = typed_allocs[j];
+      i = j;
+    }
+  typed_allocs[i].ptr = 0;
+  typed_allocs[i].type = 0;
+  --num_typed_allocs;
+  if (8*num_typed_allocs < typed_allocs_mask && typed_allocs_mask > AUX_TABLE_MIN_MASK) resize_typed_allocs(typed_allocs_mask >> 1);
+}
+
+// Returns the type of the allocation in table slot i, or 0 if it has none.
+static gc_type table_type(uint32_t i)
+{
+  if (!TABLE_IS_TYPED(i)) return 0;
+  uint32_t t = find_type_index(REMOVE_FLAG_BITS(TABLE_PTR(i)));
+  return (t != INVALID_INDEX) ? typed_allocs[t].type : 0;
+}
+
+// Records the given malloc()ed allocation to the allocation table with the given type.
+static void record_typed_gc_malloc(void *ptr, size_t bytes, gc_type type)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  record_gc_malloc(ptr, bytes);
+  if (!type) return;
+  if (2*num_typed_allocs >= typed_allocs_mask) resize_typed_allocs((typed_allocs_mask << 1) | 1);
+  insert_type(REMOVE_FLAG_BITS(ptr), type);
+  TABLE_SET_TYPED(table_find(REMOVE_FLAG_BITS(ptr)));
+}
+
+static gc_type register_type(type_info info)
+{
+  GC_MALLOC_ACQUIRE();
+  type_info *new_types = (type_info*)realloc(types, (num_types+1)*sizeof(type_info));
+  gc_type type = 0;
+  if (new_types)
+  {
+    types = new_types;
+    types[type = num_types++] = info;
+  }
+  GC_MALLOC_RELEASE();
+  return type;
+}
+
+gc_type gc_register_type(const uint32_t *bitmap, size_t num_words, int repeat)
+{
+  assert(num_words > 0);
+  size_t bitmap_bytes = (num_words+31)/32*sizeof(uint32_t);
+  uint32_t *copy = (uint32_t*)malloc(bitmap_bytes);
+  if (!copy) return 0;
+  memcpy(copy, bitmap, bitmap_bytes);
+  if (num_words % 32) copy[num_words/32] &= (1u << (num_words % 32)) - 1; // Ignore the bits past the end of the layout.
+  gc_type type = register_type((type_info){ .bitmap = copy, .num_words = (uint32_t)num_words, .repeat = repeat });
+  if (!type) free(copy);
+  return type;
+}
+
+gc_type gc_register_trace(gc_trace_func trace)
+{
+  assert(trace);
+  return register_type((type_info){ .trace = trace });
+}
+
+void *gc_malloc_typed(size_t bytes, gc_type type)
+{
+  assert(type < num_types);
+  ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  gc_pace();
+  void *ptr = malloc(bytes);
+  if (!ptr) return 0;
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  record_typed_gc_malloc(ptr, bytes, type);
+  GC_MALLOC_RELEASE();
+  return ptr;
+}
+
+void *gc_calloc_typed(size_t bytes, gc_type type)
+{
+  assert(type < num_types);
+  ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  gc_pace();
+  void *ptr = calloc(bytes, 1);
+  if (!ptr) return 0;
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  record_typed_gc_malloc(ptr, bytes, type);
+  GC_MALLOC_RELEASE();
+  return ptr;
+}
+
+// Marks the pointers of the given typed allocation.
+static void mark_typed(void *ptr, size_t bytes, gc_type type)
+{
+  const type_info *t = &types[type];
+  if (t->trace)
+  {
+    t->trace(ptr, bytes, mark_maybe_ptr);
+    return;
+  }
+  void **words = (void**)ptr;
+  size_t num_words = bytes / sizeof(void*);
+  for(size_t base = 0; base < num_words; base += t->num_words)
+  {
+    for(uint32_t w = 0; w < (t->num_words+31)/32; ++w)
+      for(uint32_t b = t->bitmap[w], offset; b; b ^= 1u << offset)
+      {
+        size_t i = base + w*32 + (offset = __builtin_ctz(b));
+        if (i >= num_words) return; // The allocation ends in the middle of the layout.
+        mark_maybe_ptr(words[i]);
+      }
+    if (!t->repeat) break;
+  }
+}
+
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+// Returns the size of the pieces in which an allocation of the given type can be scanned, or 0 if it must be scanned
+// at once. Repeating layouts are split at layout boundaries, so that each piece starts at the start of the layout.
+static size_t scan_chunk_size(gc_type type)
+{
+  if (!type) return EMGC_SCAN_CHUNK_SIZE;
+  const type_info *t = &types[type];
+  size_t layout_bytes = t->num_words * sizeof(void*);
+  if (t->trace || !t->repeat || layout_bytes > EMGC_SCAN_CHUNK_SIZE) return 0;
+  return EMGC_SCAN_CHUNK_SIZE / layout_bytes * layout_bytes;
+}
+#endif
+
+// Scans an allocation (or a chunk of a large object) that was queued for marking.
+static void scan_item(mark_item item)
+{
+  if (item.type) mark_typed(item.ptr, item.bytes, item.type);
+  else mark(item.ptr, item.bytes);
+}
@@ -5,7 +5,7 @@ typedef struct weak_ptr_map
 } weak_ptr_map;
 
 static weak_ptr_map *weak_ptrs;
-static uint32_t num_weak_ptrs, num_weak_ptrs_entries, weak_ptrs_mask;
+static uint32_t num_weak_ptrs, weak_ptrs_mask;
 
 static uint32_t hash_to_weak_ptr_map(void *strong_ptr) { return (uint32_t)((uintptr_t)strong_ptr >> 3) & weak_ptrs_mask; }
 
@@ -23,10 +23,9 @@ static void insert_weak_ptr(void *strong_ptr, void *weak_ptr)
   assert(weak_ptr);
 
   uint32_t i = hash_to_weak_ptr_map(strong_ptr);
-  while((uintptr_t)weak_ptrs[i].strong_ptr > 1 && weak_ptrs[i].strong_ptr != strong_ptr)
+  while(weak_ptrs[i].strong_ptr && weak_ptrs[i].strong_ptr != strong_ptr)
     i = (i+1) & weak_ptrs_mask;
 
-  if (!weak_ptrs[i].strong_ptr) ++num_weak_ptrs_entries;
   if (weak_ptrs[i].strong_ptr != strong_ptr)
   {
     ++num_weak_ptrs;
@@ -35,6 +34,71 @@ static void insert_weak_ptr(void *strong_ptr, void *weak_ptr)
   weak_ptrs[i].weak_ptr = weak_ptr;
 }
 
+// Rehashes the weak pointer map to the given size.
+static void resize_weak_ptrs(uint32_t new_mask)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t old_mask = weak_ptrs_mask;
+  weak_ptr_map *old_weak_ptrs = weak_ptrs;
+  weak_ptrs_mask = new_mask;
+  weak_ptrs = (weak_ptr_map*)calloc(weak_ptrs_mask+1, sizeof(weak_ptr_map));
+  assert(weak_ptrs);
+  num_weak_ptrs = 0;
+
+  if (old_weak_ptrs)
+  {
+    for(uint32_t i = 0; i <= old_mask; ++i)
+      if (old_weak_ptrs[i].strong_ptr)
+        insert_weak_ptr(old_weak_ptrs[i].strong_ptr, old_weak_ptrs[i].weak_ptr);
+    free(old_weak_ptrs);
+  }
+}
+
+// Grows the weak pointer map if needed, so that one more strong ptr -> weak ptr mapping can be inserted.
+static void reserve_weak_ptr()
+{
+  if (2*num_weak_ptrs >= weak_ptrs_mask) resize_weak_ptrs((weak_ptrs_mask << 1) | 1);
+}
+
+// Removes the mapping in slot i with backward shift deletion, and shrinks the map if it has become overly sparse.
+static void erase_weak_ptr(uint32_t i)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  for(uint32_t j = (i+1) & weak_ptrs_mask; weak_ptrs[j].strong_ptr; j = (j+1) & weak_ptrs_mask)
+    if (((j - hash_to_weak_ptr_map(weak_ptrs[j].strong_ptr)) & weak_ptrs_mask) >= ((j - i) & weak_ptrs_mask))
+    {
+      weak_ptrs[i] = weak_ptrs[j];
+      i = j;
+    }
+  weak_ptrs[i].strong_ptr = 0;
+  weak_ptrs[i].weak_ptr = 0;
+  --num_weak_ptrs;
+  if (8*num_weak_ptrs < weak_ptrs_mask && weak_ptrs_mask > AUX_TABLE_MIN_MASK) resize_weak_ptrs(weak_ptrs_mask >> 1);
+}
+
+// Flags the table slot of the given allocation if a weak pointer refers to it. (Arena and large objects have no table
+// slot, and are detached from their weak pointers when num_weak_ptrs > 0.)
+static void table_set_has_weak(void *strong_ptr)
+{
+  if (find_weak_ptr_index(strong_ptr) == INVALID_INDEX) return;
+  uint32_t i = table_find(strong_ptr);
+  if (i != INVALID_INDEX) TABLE_SET_HAS_WEAK(i);
+}
+
+// Moves the weak pointer reference block (if any) of strong_ptr over to refer to new_strong_ptr.
+static void move_weak_ptr(void *strong_ptr, void *new_strong_ptr)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  uint32_t i = find_weak_ptr_index(strong_ptr);
+  if (i == INVALID_INDEX) return;
+  void **weak_ptr = weak_ptrs[i].weak_ptr;
+  erase_weak_ptr(i);
+  reserve_weak_ptr();
+  insert_weak_ptr(new_strong_ptr, weak_ptr);
+  table_set_has_weak(new_strong_ptr);
+  *weak_ptr = new_strong_ptr;
+}
+
 static void remove_weak_ptr(void *strong_ptr)
 {
   assert(strong_ptr);
@@ -42,11 +106,9 @@ static void remove_weak_ptr(void *strong_ptr)
   if (i == INVALID_INDEX) return; // There was no strong->weak link to this allocation.
   assert(weak_ptrs[i].strong_ptr == strong_ptr);
   assert(weak_ptrs[i].weak_ptr != 0);
-  gc_unmake_root(weak_ptrs[i].weak_ptr); // Unpin the weak reference block for garbage collection.
+  unmake_root(weak_ptrs[i].weak_ptr); // Unpin the weak reference block for garbage collection.
   *weak_ptrs[i].weak_ptr = 0;
-  weak_ptrs[i].strong_ptr = (void*)1;
-  weak_ptrs[i].weak_ptr = 0;
-  --num_weak_ptrs;
+  erase_weak_ptr(i);
 }
 
 int gc_is_weak_ptr(void *ptr)
@@ -54,9 +116,10 @@ int gc_is_weak_ptr(void *ptr)
   if (!ptr) return 0;
   if (!gc_looks_like_ptr((uintptr_t)ptr)) return 0;
   ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
-  uint32_t i = table_find(ptr);
-  int is_weak = (i != INVALID_INDEX && HAS_WEAK_BIT(table[i]));
+  uint32_t i = table_find(ptr); // N.b. arena objects are never weak pointer reference blocks.
+  int is_weak = (i != INVALID_INDEX && HAS_WEAK_BIT(TABLE_PTR(i)));
   GC_MALLOC_RELEASE();
   return is_weak;
 }
@@ -66,9 +129,26 @@ int gc_is_strong_ptr(void *ptr)
   if (!ptr) return 0;
   if (!gc_looks_like_ptr((uintptr_t)ptr)) return 0;
   ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    int is_strong = (arena_object_index(page, ptr) != INVALID_INDEX);
+    GC_MALLOC_RELEASE();
+    return is_strong;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  if (los_span_of(ptr))
+  {
+    GC_MALLOC_RELEASE();
+    return 1;
+  }
+#endif
   uint32_t i = table_find(ptr);
-  int is_strong = (i != INVALID_INDEX && !HAS_WEAK_BIT(table[i]));
+  int is_strong = (i != INVALID_INDEX && !HAS_WEAK_BIT(TABLE_PTR(i)));
   GC_MALLOC_RELEASE();
   return is_strong;
 }
@@ -80,6 +160,7 @@ void *gc_get_weak_ptr(void *strong_ptr)
  
   // See if there already exists a weak pointer reference block for this allocation.
   ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  tlab_flush(); // The allocation may still be buffered in this thread's TLAB, and must be in the table to be flagged.
   GC_MALLOC_ACQUIRE(); // acquire lock early, so that parallel calls to this function won't race to allocate.
   uint32_t i = find_weak_ptr_index(strong_ptr);
   if (i != INVALID_INDEX)
@@ -97,38 +178,22 @@ void *gc_get_weak_ptr(void *strong_ptr)
     return 0;
   }
 
-  record_gc_malloc(ref_block);
+  record_gc_malloc(ref_block, sizeof(void*));
 
   // Store the strong pointer to the allocated reference block.
   *ref_block = strong_ptr;
 
-  uint32_t old_mask = weak_ptrs_mask;
-  if (2*num_weak_ptrs_entries >= weak_ptrs_mask)
-  {
-    weak_ptrs_mask = (weak_ptrs_mask << 1) | 1;
-
-    weak_ptr_map *old_weak_ptrs = weak_ptrs;
-    weak_ptrs = (weak_ptr_map*)calloc(weak_ptrs_mask+1, sizeof(weak_ptr_map));
-    assert(weak_ptrs);
-    num_weak_ptrs_entries = 0;
-
-    if (old_weak_ptrs)
-    {
-      for(uint32_t i = 0; i <= old_mask; ++i)
-        if ((uintptr_t)old_weak_ptrs[i].strong_ptr > 1)
-          insert_weak_ptr(old_weak_ptrs[i].strong_ptr, old_weak_ptrs[i].weak_ptr);
-      free(old_weak_ptrs);
-    }
-  }
+  reserve_weak_ptr();
 
   // Mark the reference block as a weak pointer and as a leaf (don't scan contents).
   // The leaf mark is what makes this reference block a weak reference to the
   // allocation.
   i = table_find(ref_block);
   assert(i != INVALID_INDEX);
-  table[i] = (void*)((uintptr_t)table[i] | PTR_WEAK_BIT | PTR_LEAF_BIT);
+  TABLE_PTR(i) = (void*)((uintptr_t)TABLE_PTR(i) | PTR_WEAK_BIT | PTR_LEAF_BIT);
   insert_weak_ptr(strong_ptr, ref_block); // Record the strong ptr -> weak ptr mapping.
-  gc_make_root(ref_block); // Finally pin the weak pointer as a root allocation.
+  table_set_has_weak(strong_ptr);
+  make_root(ref_block); // Finally pin the weak pointer as a root allocation.
   GC_MALLOC_RELEASE();
 
   return ref_block;
@@ -148,6 +213,9 @@ void *gc_acquire_strong_ptr(void **weak_ptr_ptr __attribute__((nonnull)))
   GC_MALLOC_ACQUIRE();
   void **ref_block = (void**)weak_ptr; // We have a weak pointer, so dereference the reference block
   void *strong_ptr = *ref_block; // Fetch the pointer from weak reference block.
+#ifdef EMGC_CONCURRENT_MARKING
+  if (strong_ptr && incremental_phase == INCREMENTAL_MARKING) mark_maybe_ptr(strong_ptr); // The snapshot may not have reached it.
+#endif
   GC_MALLOC_RELEASE();
   if (strong_ptr) return strong_ptr;
   // The strong allocation has been freed, so mutate the caller's weak pointer to a null pointer, so that the reference block
@@ -0,0 +1,234 @@
+// emgc-work_stealing.c implements the mark work distribution of multithreaded builds. Each marking thread owns a
+// Chase-Lev work-stealing deque of allocations to scan: the owner pushes and pops at the bottom end of its deque without
+// atomic read-modify-write operations, and threads that run out of work steal from the top end of the deques of other
+// threads. While a thread scans an object, the allocations that it pushes are only published to thieves once the scan
+// has finished, so a thread stores the bottom of its deque once per object instead of once per pointer. When a deque
+// fills up, its oldest MARK_SEGMENT_SIZE items are moved to a segment in a shared overflow list, from where any thread
+// can take them, so marking a big graph neither loses the work to other threads nor recurses on the local stack.
+// Deques are kept for reuse when their threads leave the fence, so the number of deques follows the number of threads
+// that are in the fence at the same time.
+// Objects larger than EMGC_SCAN_CHUNK_SIZE are not scanned by one thread at once: the thread that takes such an object
+// scans only its first chunk, and pushes the rest of the object back to its deque, where other threads can steal it
+// and split it further. This way all marking threads scan disjoint ranges of a huge object in parallel.
+
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+
+#ifndef EMGC_MARK_DEQUE_SIZE
+#define EMGC_MARK_DEQUE_SIZE 1024 // Capacity of the mark deque of each thread. Must be a power of two, and at least 4.
+#endif
+#define MARK_DEQUE_MASK (EMGC_MARK_DEQUE_SIZE-1)
+#define MAX_MARK_DEQUES 64 // Threads beyond this many cannot queue work, and leave it to the overflow recovery of emgc-mark_stack.c.
+#define MARK_SEGMENT_SIZE (EMGC_MARK_DEQUE_SIZE < 1024 ? EMGC_MARK_DEQUE_SIZE/4 : 256) // Number of items that a full deque moves to the overflow list at a time.
+#ifndef EMGC_SCAN_CHUNK_SIZE
+#define EMGC_SCAN_CHUNK_SIZE (1024*1024) // Objects larger than this many bytes are scanned in pieces of this size, in parallel.
+#endif
+
+static size_t scan_chunk_size(gc_type type);
+
+typedef struct mark_deque
+{
+  _Atomic(uint32_t) top; // Thieves take items from the top.
+  _Atomic(uint32_t) bottom; // The owner pushes and pops items at the bottom. Items below this are visible to thieves.
+  _Atomic(int) owned; // Nonzero if a thread uses this deque.
+  mark_item items[EMGC_MARK_DEQUE_SIZE];
+} mark_deque;
+
+typedef struct mark_segment
+{
+  struct mark_segment *next;
+  mark_item items[MARK_SEGMENT_SIZE];
+} mark_segment;
+
+static _Atomic(mark_deque*) mark_deques[MAX_MARK_DEQUES];
+static _Atomic(uint32_t) num_mark_deques; // Number of slots of mark_deques[] that have been claimed, at most MAX_MARK_DEQUES.
+static __thread mark_deque *this_thread_deque;
+static __thread uint32_t this_thread_deque_bottom; // The actual bottom of this thread's deque, including the unpublished items.
+static __thread int this_thread_batching_pushes; // If set, pushed items are published only by mark_publish().
+static __thread uint32_t this_thread_steal_start;
+
+static mark_segment *overflow_segments;
+static _Atomic(uint32_t) num_overflow_segments;
+static emscripten_lock_t overflow_lock = EMSCRIPTEN_LOCK_T_STATIC_INITIALIZER;
+
+static _Atomic(int) num_threads_marking; // Number of threads in mark_from_queue() that are scanning, and may push more work.
+
+static mark_deque *acquire_mark_deque()
+{
+  if (this_thread_deque) return this_thread_deque;
+  uint32_t n = num_mark_deques;
+  for(uint32_t i = 0; i < n && !this_thread_deque; ++i) // Reuse a deque that a thread has released.
+  {
+    mark_deque *d = mark_deques[i];
+    int unowned = 0;
+    if (d && __c11_atomic_compare_exchange_strong(&d->owned, &unowned, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) this_thread_deque = d;
+  }
+  if (!this_thread_deque)
+  {
+    // Claim a new slot, but never count past MAX_MARK_DEQUES. A thread that gets no deque cannot queue work, so each
+    // allocation that it marks sets mark_overflowed, and is scanned later by the overflow recovery.
+    uint32_t i;
+    do
+    {
+      if ((i = num_mark_deques) >= MAX_MARK_DEQUES) return 0;
+    } while(cas_u32(&num_mark_deques, i, i+1) != i);
+    mark_deque *d = (mark_deque*)calloc(1, sizeof(mark_deque));
+    if (!d) return 0;
+    d->owned = 1;
+    mark_deques[i] = this_thread_deque = d;
+  }
+  this_thread_deque_bottom = this_thread_deque->bottom;
+  return this_thread_deque;
+}
+
+// Called when the thread leaves the fence. The deque is left for the thieves to finish if it still has items in it.
+static void release_mark_deque()
+{
+  mark_deque *d = this_thread_deque;
+  if (!d || d->top != d->bottom) return;
+  this_thread_deque = 0;
+  d->owned = 0;
+}
+
+// Makes the items that this thread has pushed visible to thieves.
+static void mark_publish()
+{
+  if (this_thread_deque) this_thread_deque->bottom = this_thread_deque_bottom;
+}
+
+// Moves the oldest MARK_SEGMENT_SIZE items of this thread's full deque to the overflow list. Returns 0 if out of memory.
+static int mark_spill(mark_deque *d)
+{
+  mark_segment *s = (mark_segment*)malloc(sizeof(mark_segment));
+  if (!s) return 0;
+  mark_publish(); // Thieves may only take published items, so publish all items before taking them from the top.
+  for(;;)
+  {
+    uint32_t t = d->top;
+    if (this_thread_deque_bottom - t < EMGC_MARK_DEQUE_SIZE) // Thieves made room in the meanwhile.
+    {
+      free(s);
+      return 1;
+    }
+    for(uint32_t i = 0; i < MARK_SEGMENT_SIZE; ++i) s->items[i] = d->items[(t+i) & MARK_DEQUE_MASK];
+    if (cas_u32(&d->top, t, t + MARK_SEGMENT_SIZE) == t) break;
+  }
+  gc_acquire_lock(&overflow_lock);
+  s->next = overflow_segments;
+  overflow_segments = s;
+  ++num_overflow_segments;
+  gc_release_lock(&overflow_lock);
+  return 1;
+}
+
+// Pushes an allocation (or a chunk of a large object) to scan to this thread's deque.
+static void mark_push(mark_item item)
+{
+  mark_deque *d = acquire_mark_deque();
+  if (!d || (this_thread_deque_bottom - d->top >= EMGC_MARK_DEQUE_SIZE && !mark_spill(d)))
+  {
+    mark_overflowed = 1; // Out of memory, so leave the allocation unscanned for now, and recover from it at the end of marking.
+    return;
+  }
+  d->items[this_thread_deque_bottom++ & MARK_DEQUE_MASK] = item;
+  if (!this_thread_batching_pushes) d->bottom = this_thread_deque_bottom;
+}
+
+// Pops the most recently pushed item from this thread's deque. Returns 0 if the deque is empty.
+static int mark_pop(mark_item *item)
+{
+  mark_deque *d = this_thread_deque;
+  if (!d) return 0;
+  if (this_thread_deque_bottom != d->bottom) // Unpublished items are private to this thread.
+  {
+    *item = d->items[--this_thread_deque_bottom & MARK_DEQUE_MASK];
+    return 1;
+  }
+  uint32_t b = this_thread_deque_bottom - 1;
+  d->bottom = b; // Claim the bottom item before looking at the top, so that a thief cannot take it unnoticed.
+  uint32_t t = d->top;
+  if ((int32_t)(b - t) < 0) // The deque was empty.
+  {
+    d->bottom = this_thread_deque_bottom = t;
+    return 0;
+  }
+  *item = d->items[b & MARK_DEQUE_MASK];
+  if (b != t)
+  {
+    this_thread_deque_bottom = b;
+    return 1;
+  }
+  int won = (cas_u32(&d->top, t, t+1) == t); // The last item: race against thieves for it.
+  d->bottom = this_thread_deque_bottom = t+1;
+  return won;
+}
+
+static int mark_steal_from(mark_deque *d, mark_item *item)
+{
+  uint32_t t = d->top;
+  if ((int32_t)(d->bottom - t) <= 0) return 0;
+  *item = d->items[t & MARK_DEQUE_MASK];
+  return cas_u32(&d->top, t, t+1) == t;
+}
+
+// Steals an item from the deque of some other thread.
+static int mark_steal(mark_item *item)
+{
+  uint32_t n = num_mark_deques;
+  for(uint32_t i = 0; i < n; ++i)
+  {
+    mark_deque *d = mark_deques[(this_thread_steal_start + i) % n];
+    if (d && d != this_thread_deque && mark_steal_from(d, item))
+    {
+      this_thread_steal_start += i; // Start from the same victim next time.
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Moves the items of an overflow segment to this thread's deque. Returns 0 if there were no segments.
+static int mark_take_segment()
+{
+  if (!num_overflow_segments) return 0;
+  gc_acquire_lock(&overflow_lock);
+  mark_segment *s = overflow_segments;
+  if (s)
+  {
+    overflow_segments = s->next;
+    --num_overflow_segments;
+  }
+  gc_release_lock(&overflow_lock);
+  if (!s) return 0;
+  for(uint32_t i = 0; i < MARK_SEGMENT_SIZE; ++i) mark_push(s->items[i]);
+  free(s);
+  return 1;
+}
+
+// Takes the next item to scan: from this thread's own deque, then from the overflow list, or else by stealing.
+static int mark_next(mark_item *item)
+{
+  if (!mark_pop(item) && !(mark_take_segment() && mark_pop(item)) && !mark_steal(item)) return 0;
+  size_t chunk = scan_chunk_size(item->type);
+  if (chunk && item->bytes > chunk) // Scan only the first chunk of a large object, and let other threads steal the rest.
+  {
+    mark_push((mark_item){ (char*)item->ptr + chunk, item->bytes - chunk, item->type });
+    mark_publish();
+    item->bytes = chunk;
+  }
+  return 1;
+}
+
+// Returns 1 if some thread has published items that could be stolen, or root chunks are left to claim.
+static int mark_work_available()
+{
+  if (num_overflow_segments || mark_overflowed || root_chunks_pending()) return 1;
+  uint32_t n = num_mark_deques;
+  for(uint32_t i = 0; i < n; ++i)
+  {
+    mark_deque *d = mark_deques[i];
+    if (d && (int32_t)(d->bottom - d->top) > 0) return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -13,13 +13,21 @@
 // variables yourself, skipping automatic marking can improve performance.
 // #define EMGC_SKIP_AUTOMATIC_STATIC_MARKING
 
+// Pass this define to only scan the globals that are declared with GC_MANAGED_GLOBAL, which the linker gathers to their
+// own section, instead of the whole global memory.
+// #define EMGC_SCAN_MANAGED_GLOBALS_ONLY
+
+#if defined(EMGC_CONCURRENT_MARKING) && !defined(__EMSCRIPTEN_SHARED_MEMORY__)
+#undef EMGC_CONCURRENT_MARKING // Concurrent marking traces on the sweep worker, so it is only available in multithreaded builds.
+#endif
+
 #define IS_ALIGNED(ptr, size) (((uintptr_t)(ptr) & ((size)-1)) == 0)
 #define BITVEC_GET(arr, i)  (((arr)[(i)>>3] &    1<<((i)&7)) != 0)
 #define BITVEC_SET(arr, i)   ((arr)[(i)>>3] |=   1<<((i)&7))
 #define BITVEC_CLEAR(arr, i) ((arr)[(i)>>3] &= ~(1<<((i)&7)))
 #define REMOVE_FLAG_BITS(ptr) ((void*)((uintptr_t)(ptr) & ~(uintptr_t)7))
 #define INVALID_INDEX ((uint32_t)-1)
-#define SENTINEL_PTR ((void*)31) // Use a magic constant bit pattern that is > 0 and > all flag bits, but < any valid ptr, to represent a deleted allocation from hash table.
+#define AUX_TABLE_MIN_MASK 15 // The roots, finalizers, weak pointer and custom root block tables do not shrink below 16 slots.
 #define PTR_FINALIZER_BIT ((uintptr_t)1)
 #define PTR_LEAF_BIT ((uintptr_t)2)
 #define PTR_WEAK_BIT ((uintptr_t)4)
@@ -28,158 +36,409 @@
 #define HAS_WEAK_BIT(ptr) (((uintptr_t)(ptr) & PTR_WEAK_BIT))
 
 size_t malloc_usable_size(void*);
-void * __attribute__((weak, __visibility__("default"))) emmalloc_realloc_zeroed(void *ptr, size_t size) { free(ptr); return calloc(size, 1); }
+// In-place resize functions of emmalloc and dlmalloc. Whichever allocator is linked in defines its own.
+void *emmalloc_realloc_try(void *ptr, size_t size) __attribute__((weak));
+void *dlrealloc_in_place(void *ptr, size_t size) __attribute__((weak));
+// Frees an array of pointers. dlmalloc provides this, taking its lock only once, and merging neighbouring chunks
+// that follow each other in the array. Other allocators free the pointers one by one.
+size_t __attribute__((weak, __visibility__("default"))) dlbulk_free(void **ptrs, size_t n) { for(size_t i = 0; i < n; ++i) free(ptrs[i]); return 0; }
 
 extern char __global_base, __data_end, __heap_base;
+#ifdef EMGC_SCAN_MANAGED_GLOBALS_ONLY
+extern char __start_emgc_globals __attribute__((weak)), __stop_emgc_globals __attribute__((weak)); // Null if no GC_MANAGED_GLOBALs exist.
+#define STATIC_ROOTS_START ((void*)&__start_emgc_globals)
+#define STATIC_ROOTS_END ((void*)&__stop_emgc_globals)
+#else
+#define STATIC_ROOTS_START ((void*)&__global_base)
+#define STATIC_ROOTS_END ((void*)&__data_end)
+#endif
 
-static void **table;
-static uint8_t *mark_table, *used_table;
-static uint32_t num_allocs, num_table_entries, table_mask;
+// The managed allocation table is an open addressing hash table that is probed in groups of 16 slots. Each slot has a
+// control byte that is either CTRL_EMPTY, CTRL_DELETED, or holds a 7-bit fragment of the hash of the pointer in the slot,
+// so a lookup compares its hash fragment against the whole group at once (with a single SIMD compare in SIMD builds),
+// and only dereferences the slots that match. The used and mark bits of the slots are stored in the same group, so a
+// lookup and mark typically only touches one group.
+#define TABLE_GROUP_SIZE 16
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+typedef struct table_group
+{
+  uint8_t ctrl[TABLE_GROUP_SIZE];
+  uint16_t used, mark; // Bit i is set if slot i of the group holds an allocation, or if that allocation has been marked.
+  uint16_t typed; // Bit i is set if the allocation in slot i has a type, see emgc-typed.c.
+  uint16_t has_weak; // Bit i is set if a weak pointer refers to the allocation in slot i, so that freeing it must detach the weak pointer.
+  void *ptrs[TABLE_GROUP_SIZE]; // Managed pointers, with their PTR_*_BIT flags in the low bits.
+  uint32_t sizes[TABLE_GROUP_SIZE]; // Requested sizes of the allocations in bytes. Marking scans only this many bytes.
+} table_group;
+
+#define TABLE_PTR(i) (table[(i)/TABLE_GROUP_SIZE].ptrs[(i)%TABLE_GROUP_SIZE]) // Accesses the table slot of the given index.
+#define TABLE_SIZE(i) (table[(i)/TABLE_GROUP_SIZE].sizes[(i)%TABLE_GROUP_SIZE])
+#define TABLE_IS_MARKED(i) ((table[(i)/TABLE_GROUP_SIZE].mark >> ((i)%TABLE_GROUP_SIZE)) & 1)
+#define TABLE_SET_MARK(i) (table[(i)/TABLE_GROUP_SIZE].mark |= (uint16_t)(1u << ((i)%TABLE_GROUP_SIZE)))
+#define TABLE_IS_TYPED(i) ((table[(i)/TABLE_GROUP_SIZE].typed >> ((i)%TABLE_GROUP_SIZE)) & 1)
+#define TABLE_SET_TYPED(i) (table[(i)/TABLE_GROUP_SIZE].typed |= (uint16_t)(1u << ((i)%TABLE_GROUP_SIZE)))
+#define TABLE_SET_HAS_WEAK(i) (table[(i)/TABLE_GROUP_SIZE].has_weak |= (uint16_t)(1u << ((i)%TABLE_GROUP_SIZE)))
+
+static table_group *table;
+static uint32_t num_allocs, num_table_entries, table_mask; // num_table_entries counts slots that are not CTRL_EMPTY. table_mask+1 is the number of slots.
+static uint32_t table_min_mask = 127; // The table does not shrink below this size. Raised by gc_reserve().
+
+// When the table grows, the allocations are not rehashed all at once while holding the GC lock. Instead the old table is
+// kept alongside the new one, and each recorded allocation migrates TABLE_MIGRATE_GROUPS groups of the old table over.
+// Lookups that miss in the new table fall back to the old table, and move the allocation they find. Collections finish
+// any ongoing migration before marking, so marking and sweeping only ever see a single table.
+#define TABLE_MIGRATE_GROUPS 4
+static table_group *old_table;
+static uint32_t old_table_mask, old_table_migrated_groups;
+
+// Progress of an incremental collection, see emgc-incremental.c. While an incremental collection is in progress, new
+// allocations are created marked, so that the collection neither needs to scan them nor frees them.
+#define INCREMENTAL_IDLE 0
+#define INCREMENTAL_MARKING 1
+#define INCREMENTAL_SWEEPING 2
+static uint8_t incremental_phase;
 
 static uint32_t table_find(void *ptr);
+static void realloc_table(void);
+static void table_finish_migration(void);
+static void begin_collection_locked(int minor);
+static void record_gc_malloc(void *ptr, size_t bytes);
 static void remove_weak_ptr(void *strong_ptr);
+static void table_set_has_weak(void *strong_ptr);
+static void make_root(void *ptr);
+static void unmake_root(void *ptr);
+static void scan_object(void *ptr, size_t bytes, gc_type type);
+static void remove_type(void *ptr);
+static gc_type table_type(uint32_t i);
+static int mark_looks_like_ptr(uintptr_t val);
+static void mark_maybe_ptr(void *ptr);
 
 #include "emgc-multithreaded.c"
+#include "emgc-work_stealing.c"
+#include "emgc-tlab.c"
+#include "emgc-concurrent.c"
+#include "emgc-pacing.c"
+#include "emgc-heap_index.c"
+#include "emgc-arena.c"
+#include "emgc-large_object_space.c"
 #include "emgc-finalizer.c"
+#include "emgc-typed.c"
 #include "emgc-sleep.c"
 
-static uint32_t hash_ptr(void *ptr) { return (uint32_t)((uintptr_t)ptr >> 3) & table_mask; }
+// The low bits of the hash select the group to start probing from, and the high 7 bits are stored in the control byte.
+static uint32_t hash_ptr(void *ptr)
+{
+  uint32_t h = (uint32_t)((uintptr_t)ptr >> 3) * 0x9E3779B1u;
+  return h ^ (h >> 16);
+}
+
+// Returns a bitmask of the slots in the given group whose control byte equals ctrl.
+#ifdef __wasm_simd128__
+static uint32_t group_match(const table_group *group, uint8_t ctrl)
+{
+  return wasm_i8x16_bitmask(wasm_i8x16_eq(wasm_v128_load(group->ctrl), wasm_u8x16_splat(ctrl)));
+}
+#else
+static uint32_t group_match(const table_group *group, uint8_t ctrl)
+{
+  uint32_t bits = 0;
+  for(uint32_t i = 0; i < TABLE_GROUP_SIZE; ++i) bits |= (uint32_t)(group->ctrl[i] == ctrl) << i;
+  return bits;
+}
+#endif
 
 static int gc_looks_like_ptr(uintptr_t val)
 {
   return (IS_ALIGNED(val, 8) && val - (uintptr_t)&__heap_base < (uintptr_t)emscripten_get_heap_size() - (uintptr_t)&__heap_base);
 }
 
-static uint32_t table_find(void *ptr)
+#ifdef EMGC_INTERIOR_POINTERS
+#define MARK_PTR_ALIGN_MASK 0 // In interior pointer mode, a pointer to any byte of an allocation keeps the allocation alive.
+#else
+#define MARK_PTR_ALIGN_MASK 7
+#endif
+
+// Like gc_looks_like_ptr(), but for values found during marking: these are checked against the pages of the heap that
+// hold managed memory, to avoid probing the allocation table for values that point to other memory.
+static int mark_looks_like_ptr(uintptr_t val)
+{
+  return ((val & MARK_PTR_ALIGN_MASK) == 0 && heap_index_maybe_managed(val));
+}
+
+// Returns the index of ptr in the given table, or INVALID_INDEX if it is not there.
+static uint32_t table_probe(table_group *t, uint32_t mask, void *ptr)
+{
+  if (!t) return INVALID_INDEX; // No allocations have been made yet, or there is no old table.
+  uint32_t h = hash_ptr(ptr), group_mask = mask / TABLE_GROUP_SIZE;
+  for(uint32_t g = h & group_mask;; g = (g+1) & group_mask)
+  {
+    table_group *group = &t[g];
+    for(uint32_t bits = group_match(group, h >> 25), offset; bits; bits ^= 1u << offset)
+      if (REMOVE_FLAG_BITS(group->ptrs[offset = __builtin_ctz(bits)]) == ptr) return g*TABLE_GROUP_SIZE + offset;
+    if (group_match(group, CTRL_EMPTY)) return INVALID_INDEX; // A probe sequence never continues past a group that has an empty slot.
+  }
+}
+
+static uint32_t table_insert(void *ptr, uint32_t bytes)
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
-  for(uint32_t i = hash_ptr(ptr); table[i]; i = (i+1) & table_mask)
-    if (REMOVE_FLAG_BITS(table[i]) == ptr) return i;
-  return INVALID_INDEX;
+  uint32_t h = hash_ptr(REMOVE_FLAG_BITS(ptr)), group_mask = table_mask / TABLE_GROUP_SIZE;
+  uint32_t g = h & group_mask;
+  while(table[g].used == 0xFFFF) g = (g+1) & group_mask; // Insert to the first group that has an empty or a deleted slot.
+  table_group *group = &table[g];
+  uint32_t i = __builtin_ctz(~(uint32_t)group->used);
+  if (group->ctrl[i] == CTRL_EMPTY) ++num_table_entries;
+  group->ctrl[i] = (uint8_t)(h >> 25);
+  group->used |= (uint16_t)(1u << i);
+  group->mark &= (uint16_t)~(1u << i); // A freed slot may have been left marked.
+  group->typed &= (uint16_t)~(1u << i);
+  group->has_weak &= (uint16_t)~(1u << i);
+  group->ptrs[i] = ptr;
+  group->sizes[i] = bytes;
+  return g*TABLE_GROUP_SIZE + i;
 }
 
-static void table_insert(void *ptr)
+// Moves the allocations of the next num_groups groups of the old table over to the table, and frees the old table once
+// it has been emptied.
+static void table_migrate(uint32_t num_groups)
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
-  uint32_t i = hash_ptr(ptr);
-  uint32_t i64 = i>>6;
-  uint64_t *used64 = (uint64_t*)used_table;
-  uint64_t u = used64[i64] | ((1ull<<(i&63))-1); // Mask off all indices that come before the initial hash index
-  assert((table_mask+1) % 64 == 0); // invariant on table sizes guarantees they are always a multiple of 64 entries.
-  while(u == (uint64_t)-1)
-    u = used64[(i64 = (i64+1) & (table_mask >> 6))];
-  i = (i64<<6) + __builtin_ctzll(~u);
-  if (!table[i]) ++num_table_entries;
-  table[i] = ptr;
-  assert(!BITVEC_GET(used_table, i)); // Bitfield must have been clear to insert.
-  BITVEC_SET(used_table, i);
-  ++num_allocs;
+  if (!old_table) return;
+  uint32_t old_num_groups = (old_table_mask+1) / TABLE_GROUP_SIZE;
+  uint32_t end = (num_groups < old_num_groups - old_table_migrated_groups) ? old_table_migrated_groups + num_groups : old_num_groups;
+  for(; old_table_migrated_groups < end; ++old_table_migrated_groups)
+  {
+    table_group *group = &old_table[old_table_migrated_groups];
+    for(uint32_t bits = group->used, offset; bits; bits ^= 1u << offset)
+    {
+      offset = __builtin_ctz(bits);
+      uint32_t i = table_insert(group->ptrs[offset], group->sizes[offset]);
+      if ((group->mark >> offset) & 1) TABLE_SET_MARK(i); // Carry over the old generation status in generational mode.
+      if ((group->typed >> offset) & 1) TABLE_SET_TYPED(i);
+      if ((group->has_weak >> offset) & 1) TABLE_SET_HAS_WEAK(i);
+    }
+    group->used = 0;
+    memset(group->ctrl, CTRL_DELETED, TABLE_GROUP_SIZE); // Lookups to the old table must keep probing past migrated groups.
+  }
+  if (old_table_migrated_groups == old_num_groups)
+  {
+    free(old_table);
+    old_table = 0;
+  }
 }
 
-static void table_free(uint32_t i)
+static void table_finish_migration(void) { table_migrate((uint32_t)-1); }
+
+static uint32_t table_find(void *ptr)
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
-  assert(table[i] > SENTINEL_PTR);
-  assert(BITVEC_GET(used_table, i)); // There must be a valid entry in this table index.
-  void *ptr = REMOVE_FLAG_BITS(table[i]);
+  uint32_t i = table_probe(table, table_mask, ptr);
+  if (i == INVALID_INDEX && old_table && (i = table_probe(old_table, old_table_mask, ptr)) != INVALID_INDEX)
+  {
+    // The allocation has not been migrated yet, so move it to the table now, so that the caller gets an index to it.
+    table_group *group = &old_table[i / TABLE_GROUP_SIZE];
+    uint32_t slot = i % TABLE_GROUP_SIZE;
+    group->ctrl[slot] = CTRL_DELETED;
+    group->used &= (uint16_t)~(1u << slot);
+    uint32_t marked = (group->mark >> slot) & 1, typed = (group->typed >> slot) & 1, has_weak = (group->has_weak >> slot) & 1;
+    i = table_insert(group->ptrs[slot], group->sizes[slot]);
+    if (marked) TABLE_SET_MARK(i);
+    if (typed) TABLE_SET_TYPED(i);
+    if (has_weak) TABLE_SET_HAS_WEAK(i);
+  }
+  return i;
+}
+
+// Detaches the allocation in table slot i from the weak pointer, type and heap index tables, before it is freed.
+// Returns the allocation.
+static void *table_release(uint32_t i)
+{
+  table_group *group = &table[i / TABLE_GROUP_SIZE];
+  uint32_t slot = i % TABLE_GROUP_SIZE;
+  assert((group->used >> slot) & 1); // There must be a valid entry in this table index.
+  void *ptr = REMOVE_FLAG_BITS(group->ptrs[slot]);
+  concurrent_mark_freed(ptr, group->sizes[slot], HAS_LEAF_BIT(group->ptrs[slot]));
   // If this allocation had weak pointer references to it, detach the weak pointer reference block from this
   // allocation.
-  remove_weak_ptr(ptr);
-  // and free the pointer itself.
+  if ((group->has_weak >> slot) & 1) remove_weak_ptr(ptr);
+  if ((group->typed >> slot) & 1) remove_type(ptr);
+  heap_index_remove(ptr, group->sizes[slot]);
+  return ptr;
+}
+
+// Clears table slot i after its allocation has been freed. Only touches the group of the slot. Returns 1 if the slot
+// became empty, or 0 if it was left as a deleted marker.
+static int table_clear_slot(uint32_t i)
+{
+  table_group *group = &table[i / TABLE_GROUP_SIZE];
+  uint32_t slot = i % TABLE_GROUP_SIZE;
+  group->used &= (uint16_t)~(1u << slot);
+  group->ptrs[slot] = 0;
+  // If the group still has an empty slot, no probe sequence continues past this group, so the slot can become empty.
+  // Otherwise a deleted marker must be left behind so that lookups keep probing past this group.
+  int empty = (group_match(group, CTRL_EMPTY) != 0);
+  group->ctrl[slot] = empty ? CTRL_EMPTY : CTRL_DELETED;
+  return empty;
+}
+
+static void table_free(uint32_t i)
+{
+  ASSERT_GC_MALLOC_IS_ACQUIRED();
+  void *ptr = table_release(i);
+  pacing_count_free(malloc_usable_size(ptr));
   free(ptr);
-  BITVEC_CLEAR(used_table, i);
   --num_allocs;
-  if (table[(i+1)&table_mask]) table[i] = SENTINEL_PTR;
-  else for(;;) // Opportunistically clear sentinels if they aren't needed in these hash slots.
-  {
-    --num_table_entries;
-    table[i] = 0;
-    if (table[i = (i+table_mask) & table_mask] != SENTINEL_PTR) break;
-  }
+  num_table_entries -= table_clear_slot(i);
 }
 
-static void realloc_table()
+// Replaces the table with a new one that is sized to fit the current allocations, and starts migrating the allocations
+// over incrementally.
+static void start_table_resize(void)
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
+  table_finish_migration(); // Only one resize can be in progress at a time.
   uint32_t old_mask = table_mask;
   if (2*num_allocs >= table_mask) table_mask <<= 1; // grow table
-  else if (((8*num_allocs)|127) < table_mask) table_mask = (1 << (32-__builtin_clz((2*num_allocs)|1))) - 1; // shrink table
-  table_mask |= 127; // Minimum table size is 128 entries.
-
-  if (old_mask != table_mask)
-  {
-    mark_table = (uint8_t*)emmalloc_realloc_zeroed(mark_table, (table_mask+1)>>3);
-    assert(mark_table); // This allocation must be infallible.
-  }
-
-  uint64_t *old_used_table = (uint64_t *)used_table;
-  void **old_table = table;
-
-  used_table = (uint8_t*)calloc(((table_mask+1)>>3) + (table_mask+1)*sizeof(void*), 1);
-  table = (void**)(used_table + ((table_mask+1)>>3));
-  num_table_entries = num_allocs = 0;
-  assert(mark_table && used_table);
+  else if (((8*num_allocs)|table_min_mask) < table_mask) table_mask = (1 << (32-__builtin_clz((2*num_allocs)|1))) - 1; // shrink table
+  table_mask |= table_min_mask; // Minimum table size is 128 entries, or the size reserved with gc_reserve().
+
+  old_table = table;
+  old_table_mask = old_mask;
+  old_table_migrated_groups = 0;
+  uint32_t num_groups = (table_mask+1) / TABLE_GROUP_SIZE;
+  table = (table_group*)calloc(num_groups, sizeof(table_group));
+  assert(table); // This allocation must be infallible.
+  for(uint32_t g = 0; g < num_groups; ++g) memset(table[g].ctrl, CTRL_EMPTY, TABLE_GROUP_SIZE);
+  num_table_entries = 0;
+}
 
-  if (old_table)
-  {
-    for(uint32_t i = 0, offset; i <= old_mask; i += 64)
-      for(uint64_t bits = old_used_table[i>>6]; bits; bits ^= (1ull<<offset))
-        table_insert(old_table[i + (offset = __builtin_ctzll(bits))]);
-    free(old_used_table);
-  }
+// Resizes the table and migrates all allocations over right away.
+static void realloc_table(void)
+{
+  start_table_resize();
+  table_finish_migration();
 }
 
-static void record_gc_malloc(void *ptr)
+// Records a new malloc()ed allocation of the given requested size to the managed allocation table.
+static void record_gc_malloc(void *ptr, size_t bytes)
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
-  if (2*num_table_entries >= table_mask) realloc_table();
-  table_insert(ptr);
+  if (2*num_table_entries >= table_mask) start_table_resize();
+  uint32_t i = table_insert(ptr, (uint32_t)bytes);
+  if (incremental_phase != INCREMENTAL_IDLE) TABLE_SET_MARK(i);
+  ++num_allocs;
+  table_migrate(TABLE_MIGRATE_GROUPS);
+  heap_index_insert(REMOVE_FLAG_BITS(ptr), bytes);
+  pacing_count_malloc(malloc_usable_size(REMOVE_FLAG_BITS(ptr)));
+}
+
+void gc_reserve(size_t num)
+{
+  if (num > (1u << 29)) num = 1u << 29;
+  tlab_flush();
+  GC_MALLOC_ACQUIRE();
+  table_min_mask = ((1u << (32-__builtin_clz((2*(uint32_t)num)|1))) - 1) | 127;
+  if (table_mask < table_min_mask) realloc_table();
+  GC_MALLOC_RELEASE();
 }
 
 void *gc_malloc(size_t bytes)
 {
   ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  gc_pace();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  if (bytes <= ARENA_MAX_SIZE) return arena_malloc(bytes);
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  if (bytes >= EMGC_LARGE_OBJECT_THRESHOLD) return los_malloc(bytes);
+#endif
   void *ptr = malloc(bytes);
   if (!ptr) return 0;
-  GC_MALLOC_ACQUIRE();
-  record_gc_malloc(ptr);
-  GC_MALLOC_RELEASE();
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+  tlab_record_gc_malloc(ptr, bytes);
+#else
+  record_gc_malloc(ptr, bytes);
+#endif
   return ptr;
 }
 
 void *gc_calloc(size_t bytes)
 {
   ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  gc_pace();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  if (bytes <= ARENA_MAX_SIZE)
+  {
+    void *ptr = arena_malloc(bytes);
+    if (ptr) memset(ptr, 0, bytes);
+    return ptr;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  if (bytes >= EMGC_LARGE_OBJECT_THRESHOLD)
+  {
+    void *ptr = los_malloc(bytes);
+    if (ptr) memset(ptr, 0, bytes);
+    return ptr;
+  }
+#endif
   void *ptr = calloc(bytes, 1);
   if (!ptr) return 0;
-  GC_MALLOC_ACQUIRE();
-  record_gc_malloc(ptr);
-  GC_MALLOC_RELEASE();
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+  tlab_record_gc_malloc(ptr, bytes);
+#else
+  record_gc_malloc(ptr, bytes);
+#endif
   return ptr;
 }
 
 void *gc_calloc_root(size_t bytes)
 {
-  void *ptr = gc_calloc(bytes);
-  if (ptr) gc_make_root(ptr);
-  return ptr;
+  void *ptr;
+  return gc_malloc_batch(bytes, 1, GC_FLAG_ROOT | GC_FLAG_ZERO, 0, &ptr) ? ptr : 0; // Allocates and flags the pointer with a single lock acquisition.
 }
 
 void *gc_calloc_leaf(size_t bytes)
 {
-  void *ptr = gc_calloc(bytes);
-  if (ptr) gc_make_leaf(ptr);
-  return ptr;
+  void *ptr;
+  return gc_malloc_batch(bytes, 1, GC_FLAG_LEAF | GC_FLAG_ZERO, 0, &ptr) ? ptr : 0; // Allocates and flags the pointer with a single lock acquisition.
 }
 
 void gc_free(void *ptr)
 {
   if (!ptr) return;
   ASSERT_GC_FENCED_ACCESS_IS_ACQUIRED();
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  if (page)
+  {
+    uint32_t i = arena_object_index(page, ptr);
+    assert(i != INVALID_INDEX);
+    unmake_root(ptr);
+    remove_finalizer(ptr);
+    remove_weak_ptr(ptr);
+    arena_free(page, i);
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_span *span = los_span_of(ptr);
+  if (span)
+  {
+    unmake_root(ptr);
+    remove_finalizer(ptr);
+    remove_weak_ptr(ptr);
+    los_free(span);
+    GC_MALLOC_RELEASE();
+    return;
+  }
+#endif
   uint32_t i = table_find(ptr);
   assert(i != INVALID_INDEX);
-  gc_unmake_root(ptr);
+  unmake_root(ptr);
   remove_finalizer(ptr);
   table_free(i);
   GC_MALLOC_RELEASE();
@@ -188,42 +447,74 @@ void gc_free(void *ptr)
 #include "emgc-weak.c"
 #include "emgc-roots.c"
 #include "emgc-custom_root_blocks.c"
+#include "emgc-parallel_roots.c"
+
+// Clears the mark bits of all managed allocations.
+static void clear_marks(void)
+{
+  if (table)
+    for(uint32_t g = 0; g <= table_mask / TABLE_GROUP_SIZE; ++g) table[g].mark = 0;
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  for(uint32_t p = 0; p < num_arena_pages; ++p) memset(arena_pages[p]->mark, 0, sizeof(arena_pages[p]->mark));
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  for(uint32_t i = 0; i < los_spans.num; ++i) los_spans.spans[i]->mark = 0;
+#endif
+}
+
+#include "emgc-generational.c"
+
+// Called at the start of a collection with the GC lock held, before any thread starts marking.
+static void begin_collection_locked(int minor)
+{
+  // A lookup that hits the old table migrates the allocation, which marking threads must not do in parallel, and the
+  // sweep only clears the marks of the table, so any table resize must complete before marking.
+  table_finish_migration();
+#ifdef EMGC_GENERATIONAL
+  gen_begin_collection(minor);
+#else
+  (void)minor;
+#endif
+}
+#include "emgc-batch.c"
+#include "emgc-realloc.c"
 #include "emgc-mark.c"
+#include "emgc-mark_stack.c"
+#include "emgc-parallel_sweep.c"
 
 static void sweep()
 {
   ASSERT_GC_MALLOC_IS_ACQUIRED();
 
-  // If we didn't mark all finalizers, we know we will have GC object with
-  // finalizer to sweep. If so, find a finalizer to run.
-  if (num_finalizers_marked < num_finalizers) find_and_run_a_finalizer();
-  else // No finalizers to invoke, so perform a real sweep that frees up GC objects.
-  {
-#ifdef __wasm_simd128__
-    for(uint32_t i = 0, offset; i <= table_mask; i += 128)
-    {
-      v128_t g = wasm_v128_and(wasm_v128_load(used_table + (i>>3)), wasm_v128_not(wasm_v128_load(mark_table + (i>>3))));
-      if (wasm_v128_any_true(g))
-      {
-        for(uint64_t lo = wasm_u64x2_extract_lane(g, 0); lo; lo ^= (1ull<<offset)) table_free(i + (offset = __builtin_ctzll(lo)));
-        for(uint64_t hi = wasm_u64x2_extract_lane(g, 1); hi; hi ^= (1ull<<offset)) table_free(i + 64 + (offset = __builtin_ctzll(hi)));
-      }
-    }
-#else
-    for(uint32_t i = 0, offset; i <= table_mask; i += 64)
-      for(uint64_t b = ((uint64_t*)used_table)[i>>6] & ~((uint64_t*)mark_table)[i>>6]; b; b ^= (1ull<<offset))
-        table_free(i + (offset = __builtin_ctzll(b)));
+  // If we didn't mark all finalizers, we know we will have GC objects with finalizers to sweep. If so, queue their
+  // finalizers, and keep them (and what they point to) alive until the finalizers have run.
+  int queue_finalizers = (num_finalizers_marked < num_finalizers);
+#ifdef EMGC_GENERATIONAL
+  if (collecting_minor) queue_finalizers = (num_finalizers > 0); // Old objects were not counted in this minor collection, so look for unmarked ones.
+#endif
+  if (queue_finalizers) queue_unreachable_finalizers();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_sweep(num_weak_ptrs > 0);
+#endif
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  los_sweep(num_weak_ptrs > 0);
+#endif
+  sweep_table();
+
+  // Compactify managed allocation array if it is now overly large to fit all allocations, or rehash it in place if
+  // deleted markers have piled up, so that probe lengths track the number of live allocations and not the churn history.
+  if (((8*num_allocs)|table_min_mask) < table_mask || 8*(num_table_entries - num_allocs) > table_mask) realloc_table();
+#ifndef EMGC_GENERATIONAL // In generational mode, the mark bits stick to tell the old generation apart.
+  // Since we still hold the gc_malloc lock, this is a good moment to clear the mark bits back to zero for the next
+  // allocation (which helps avoid a tricky double synchronization at start_multithreaded_collection())
+  for(uint32_t g = 0; g <= table_mask / TABLE_GROUP_SIZE; ++g) table[g].mark = 0;
 #endif
-  }
 
-  // Compactify managed allocation array if it is now overly large to fit all allocations.
-  // Or if the size doesn't change, then since we still hold the gc_malloc lock, this
-  // is a good moment to clear the mark table back to zero for the next allocation
-  // (which helps avoid a tricky double synchronization at start_multithreaded_collection())
-  if (((8*num_allocs)|127) < table_mask) realloc_table();
-  else memset(mark_table, 0, (table_mask+1)>>3);
+  live_bytes_after_collect = managed_bytes; // Pace the next collection against the bytes that survived this one.
+  heap_index_update_bounds();
 
   GC_MALLOC_RELEASE();
+  run_finalizers_after_collection();
 }
 
 static void mark_current_thread_stack()
@@ -233,29 +524,31 @@ static void mark_current_thread_stack()
 #if defined(__EMSCRIPTEN_SHARED_MEMORY__) || defined(EMGC_FENCED)
   if (this_thread_accessing_managed_state)
     mark((void*)stack_bottom, stack_top - stack_bottom);
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+  tlab_mark();
+#endif
 #else
   mark((void*)stack_bottom, emscripten_stack_get_base() - stack_bottom);
 #endif
 }
 
-void gc_collect()
+// Marks the static data, custom root blocks, stacks and roots of the program. Always inlined like collect().
+static inline __attribute__((always_inline)) void mark_roots()
 {
-  bool need_collect = true;
-  GC_MALLOC_ACQUIRE(); // Acquire GC lock so that we know that the sweep worker has finished.
-  if (num_allocs == 0) need_collect = false; // Early out if whole program has no managed pointers alive.
-  GC_MALLOC_RELEASE(); // But release it immediately, since other threads may still sneak in a gc malloc before realizing they need to participate to collection.
-  if (!need_collect) return;
-
-  num_finalizers_marked = 0;
-
-  start_multithreaded_collection();
+#ifdef EMGC_GENERATIONAL
+  mark_dirty_cards();
+#endif
+  mark_current_thread_stack();
+  mark_ready_finalizers();
 
+#ifdef __EMSCRIPTEN_SHARED_MEMORY__
+  if (num_root_chunks) return; // The marking threads scan the rest of the roots together, see emgc-parallel_roots.c.
+#endif
 #ifndef EMGC_SKIP_AUTOMATIC_STATIC_MARKING
-  mark(&__global_base, (uintptr_t)&__data_end - (uintptr_t)&__global_base);
+  mark(STATIC_ROOTS_START, (uintptr_t)STATIC_ROOTS_END - (uintptr_t)STATIC_ROOTS_START);
 #endif
 
   mark_custom_root_blocks();
-  mark_current_thread_stack();
   mark_orphaned_stacks();
 
   if (roots)
@@ -264,25 +557,63 @@ void gc_collect()
     mark((void*)roots, (roots_mask+1)*sizeof(void*));
     gc_release_lock(&roots_lock);
   }
+}
+
+// Always inlined, so that the collection entry points do not add an extra (conservatively scanned) frame to the stack.
+static inline __attribute__((always_inline)) void collect(int minor)
+{
+#ifdef EMGC_CONCURRENT_MARKING
+  wait_for_concurrent_marking();
+#endif
+  if (incremental_phase != INCREMENTAL_IDLE) gc_collect_step(__builtin_inf()); // Complete an ongoing incremental collection first, so that its marks do not mix with this one.
+  bool need_collect = true;
+  tlab_flush(); // Publish this thread's buffered allocations before marking starts.
+  GC_MALLOC_ACQUIRE(); // Acquire GC lock so that we know that the sweep worker has finished.
+  bytes_allocated_since_collect = 0;
+  pacing_collection_pending = 0;
+  if (gc_num_ptrs() == 0) need_collect = false; // Early out if whole program has no managed pointers alive.
+  GC_MALLOC_RELEASE(); // But release it immediately, since other threads may still sneak in a gc malloc before realizing they need to participate to collection.
+  if (!need_collect) return;
+
+  num_finalizers_marked = 0;
+
+  start_multithreaded_collection(minor);
+
+  mark_roots();
 
 #if defined(__EMSCRIPTEN_SHARED_MEMORY__)
   finish_multithreaded_marking(); // In mt builds, delegate sweeping (and the active gc lock) to a sweep worker.
 #else
+  mark_recover_overflow();
   sweep(); // In st builds, complete sweeping here.
 #endif
 }
 
+void gc_collect() { collect(0); }
+void gc_collect_minor() { collect(1); }
+
 static void collect_when_stack_is_empty(void *unused) { (void)unused; gc_collect(); } // We know 100% we won't have any managed pointers on the stack frame now.
 void gc_collect_when_stack_is_empty() { emscripten_set_timeout(collect_when_stack_is_empty, 0, 0); }
 
 int gc_is_ptr(void *ptr)
 {
   if (!gc_looks_like_ptr((uintptr_t)ptr)) return 0;
+  tlab_flush();
   GC_MALLOC_ACQUIRE();
+#ifdef EMGC_SMALL_OBJECT_ARENA
+  arena_page *page = arena_page_of(ptr);
+  uint32_t i = page ? arena_object_index(page, ptr) : table_find(ptr);
+#else
   uint32_t i = table_find(ptr);
+#endif
+  int is_ptr = (i != INVALID_INDEX);
+#ifdef EMGC_LARGE_OBJECT_SPACE
+  if (!is_ptr) is_ptr = (los_span_of(ptr) != 0);
+#endif
   GC_MALLOC_RELEASE();
-  return i != INVALID_INDEX;
+  return is_ptr;
 }
 
+#include "emgc-incremental.c"
 #include "emgc-ptr_base.c"
 #include "emgc-debug.c"
@@ -10,6 +10,10 @@ extern "C" {
 void *gc_malloc(size_t bytes); // Allocates memory with unspecified (dirty) initial contents.
 void *gc_calloc(size_t bytes); // Allocates zero-initialized memory.
 
+// Resizes an allocation like realloc() does. The allocation keeps its root, leaf, finalizer and weak pointer status even
+// if it needs to be moved, in which case the old address is freed. gc_realloc(0, bytes) is gc_malloc(bytes).
+void *gc_realloc(void *ptr, size_t bytes);
+
 // Manually frees an allocation. If the allocation had a finalizer, it is *not* called.
 void gc_free(void *ptr);
 
@@ -21,18 +25,80 @@ void gc_unmake_root(void *ptr __attribute__((nonnull)));
 void gc_add_custom_root_block(void *ptr __attribute__((nonnull)), size_t bytes);
 void gc_remove_custom_root_block(void *ptr __attribute__((nonnull)));
 
+// Declares a global variable that holds managed pointers, e.g. GC_MANAGED_GLOBAL struct node *head;
+// When emgc.c is built with -DEMGC_SCAN_MANAGED_GLOBALS_ONLY, collections scan only the globals declared with this
+// macro, instead of all static data.
+#define GC_MANAGED_GLOBAL __attribute__((section("emgc_globals"), used, aligned(sizeof(void*))))
+
 void *gc_malloc_leaf(size_t bytes);
 void *gc_calloc_leaf(size_t bytes);
 void gc_make_leaf(void *ptr __attribute__((nonnull)));
 void gc_unmake_leaf(void *ptr __attribute__((nonnull)));
 
+// Typed allocations: marking only looks at the pointer slots that the type of an allocation declares, instead of
+// scanning all of its words. Register types once at startup. Type 0 means no type, i.e. all words are scanned.
+typedef uint32_t gc_type;
+typedef void (*gc_visit_func)(void *ptr);
+typedef void (*gc_trace_func)(void *ptr, size_t bytes, gc_visit_func visit); // Must call visit() on each pointer that the allocation holds, and nothing else.
+// Registers a layout of num_words pointer-sized words, where bit i of bitmap[i/32] is set if word i holds a pointer.
+// If repeat is nonzero, the layout repeats until the end of the allocation (e.g. for arrays of structs).
+gc_type gc_register_type(const uint32_t *bitmap __attribute__((nonnull)), size_t num_words, int repeat);
+gc_type gc_register_trace(gc_trace_func trace __attribute__((nonnull))); // Registers a type that is marked with a callback.
+void *gc_malloc_typed(size_t bytes, gc_type type);
+void *gc_calloc_typed(size_t bytes, gc_type type);
+
+// Reserves room in the managed allocation table for at least num allocations, so that a burst of allocations does not
+// need to grow the table repeatedly. The table does not shrink below this size at collections. gc_reserve(0) undoes this.
+void gc_reserve(size_t num);
+
 void gc_collect(void);
 void gc_collect_when_stack_is_empty(void);
 
+// Generational mode (build with -DEMGC_GENERATIONAL): gc_collect_minor() only traces and frees the allocations made
+// since the previous collection. Stores of managed pointers into older allocations must be reported with the write
+// barrier, or done with gc_store_ptr(). Without -DEMGC_GENERATIONAL, gc_collect_minor() performs a full collection.
+void gc_collect_minor(void);
+void gc_write_barrier(void *slot); // Call after storing a managed pointer to the given address.
+void gc_store_ptr(void **slot __attribute__((nonnull)), void *ptr); // *slot = ptr, between gc_pre_write_barrier(slot) and gc_write_barrier(slot).
+
+// Incremental collection: performs a part of a collection in about the given time budget, and returns 1 if the
+// collection completed, or 0 if it needs more calls. While a collection is in progress, stores of managed pointers into
+// managed allocations must be reported with the write barrier. In multithreaded builds, performs a whole gc_collect().
+int gc_collect_step(double nsecs);
+
+// Concurrent marking (multithreaded builds with -DEMGC_CONCURRENT_MARKING): the sweep worker traces the heap while the
+// program keeps running. While marking is in progress, managed pointers that are overwritten in managed allocations must
+// be reported with the pre-write barrier, or the store done with gc_store_ptr(). Otherwise the pre-write barrier is a no-op.
+void gc_pre_write_barrier(void *slot); // Call before overwriting a managed pointer at the given address.
+
+// Automatic collection pacing: collect when the bytes allocated since the previous collection exceed growth_factor
+// times the bytes that survived it. Pacing is disabled by default.
+#define GC_PACING_OFF 0
+#define GC_PACING_SYNC 1 // Collect synchronously inside the allocation functions. Only safe with --spill-pointers or in fenced mode.
+#define GC_PACING_WHEN_STACK_IS_EMPTY 2 // Schedule a gc_collect_when_stack_is_empty() call.
+void gc_set_pacing(int mode, double growth_factor);
+// Returns how many bytes have been allocated past the pacing budget. If negative, that many bytes can still be allocated
+// before pacing triggers a collection.
+int64_t gc_collection_debt(void);
+
 typedef void (*gc_finalizer)(void *ptr);
 void gc_register_finalizer(void *ptr __attribute__((nonnull)), gc_finalizer finalizer);
 gc_finalizer gc_get_finalizer(void *ptr __attribute__((nonnull)));
 void gc_remove_finalizer(void *ptr __attribute__((nonnull)));
+// Runs at most max_count of the finalizers that collections have queued, and returns the number of finalizers run.
+// Collections run the queued finalizers themselves, unless building with -DEMGC_FINALIZE_ON_DEMAND.
+size_t gc_run_finalizers(size_t max_count);
+
+// Batch API: these functions process a whole array of pointers with a single GC lock acquisition.
+#define GC_FLAG_LEAF 1 // Flags for gc_malloc_batch().
+#define GC_FLAG_ROOT 2
+#define GC_FLAG_ZERO 4 // Zero-initialize the allocations.
+// Allocates num allocations of the given size into ptrs[], with the given GC_FLAG_* flags. If finalizer is not null, it is
+// registered to each allocation. Returns the number of allocations made, less than num if running out of memory.
+size_t gc_malloc_batch(size_t bytes, size_t num, uint32_t flags, gc_finalizer finalizer, void **ptrs __attribute__((nonnull)));
+void gc_free_batch(void **ptrs __attribute__((nonnull)), size_t num); // Frees each non-null pointer in ptrs[]. Finalizers are not called.
+void gc_make_roots(void **ptrs __attribute__((nonnull)), size_t num);
+void gc_unmake_roots(void **ptrs __attribute__((nonnull)), size_t num);
 
 void *gc_get_weak_ptr(void *strong_ptr);
 // Given a weak pointer, acquire the referenced strong pointer.
@@ -74,6 +140,8 @@ void gc_log(const char *format, ...);
 
 // Internal debug functions. Only tests are allowed to access these:
 int debug_gc_num_roots_slots_populated(void);
+uint32_t debug_gc_table_size(void); // Number of slots in the allocation table.
+void debug_gc_set_batched_mark_lookups(int enabled); // If 0, the SIMD marking kernel looks up the candidates one at a time.
 
 #ifdef __cplusplus
 }
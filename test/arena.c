@@ -0,0 +1,41 @@
+// Tests that small allocations served from the small object arena are collected,
+// kept alive transitively, and coexist with large malloc()-backed allocations.
+// flags: -sSPILL_POINTERS -DEMGC_SMALL_OBJECT_ARENA
+#include "test.h"
+
+#define N 10000
+
+void **global;
+
+void func()
+{
+  global = (void**)gc_malloc(16);
+  void **prev = global;
+  for(int i = 1; i < N; ++i) // Build a linked list of small objects of varying sizes.
+  {
+    void **node = (void**)gc_malloc(16 + (i % 7) * 16);
+    *prev = node;
+    prev = node;
+  }
+  *prev = gc_malloc(4096); // Terminate the list with a large table allocation.
+  PIN(&global);
+
+  for(int i = 0; i < N; ++i) gc_malloc(i % 128); // Generate garbage.
+  require(gc_num_ptrs() == 2*N+1);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+
+  gc_collect();
+  require(gc_num_ptrs() == N+1 && "All objects in the linked list must survive, and all garbage must be freed.");
+  require(gc_is_ptr(global) && "Arena allocation must be recognized as a managed pointer.");
+  require(!gc_is_ptr((char*)global + 8) && "Interior arena pointer must not be recognized as a managed pointer.");
+  require(gc_ptr_base((char*)global + 8) == global && "gc_ptr_base() must resolve interior pointers to arena objects.");
+
+  global = 0;
+  PIN(&global);
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,36 @@
+// Tests leaf, root, finalizer and manual free operations on small object arena allocations.
+// flags: -sSPILL_POINTERS -DEMGC_SMALL_OBJECT_ARENA
+#include "test.h"
+
+int finalizer_ran = 0;
+void my_finalizer(void *ptr) { finalizer_ran = 1; }
+
+void *root;
+
+void func()
+{
+  void **leaf = (void**)gc_malloc_leaf(32);
+  *leaf = gc_malloc(32); // Not reachable, since leaves are not scanned.
+  root = gc_malloc_root(32);
+  void *finalizable = gc_malloc(32);
+  gc_register_finalizer(finalizable, my_finalizer);
+  require(gc_get_finalizer(finalizable) == my_finalizer);
+  void *freed = gc_calloc(32);
+  require(*(int*)freed == 0);
+  gc_free(freed);
+  require(gc_num_ptrs() == 4);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+
+  gc_collect();
+  require(finalizer_ran && "Finalizer of an arena object must run when it becomes garbage.");
+  gc_collect();
+  require(gc_num_ptrs() == 1 && "Only the root arena object should remain.");
+  require(gc_is_root(root));
+
+  gc_free(root);
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,57 @@
+// Tests that the roots, finalizers and weak pointer tables stay consistent when entries are removed in bulk from the
+// middle of probe runs, and the tables shrink back down.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+
+#define N 2000
+
+void *ptrs[N];
+void *weak[N];
+int num_finalized = 0;
+void my_finalizer(void *ptr) { ++num_finalized; }
+
+void func()
+{
+  for(int i = 0; i < N; ++i)
+  {
+    ptrs[i] = gc_calloc_root(16);
+    gc_register_finalizer(ptrs[i], my_finalizer);
+    weak[i] = gc_get_weak_ptr(ptrs[i]);
+  }
+  for(int i = 1; i < N; i += 2)
+  {
+    gc_unmake_root(ptrs[i]);
+    gc_remove_finalizer(ptrs[i]);
+  }
+  for(int i = 0; i < N; ++i)
+  {
+    require(gc_is_root(ptrs[i]) == !(i & 1));
+    require((gc_get_finalizer(ptrs[i]) == my_finalizer) == !(i & 1));
+    require(gc_acquire_strong_ptr(&weak[i]) == ptrs[i]);
+  }
+  for(int i = 0; i < N; ++i) ptrs[i] = 0;
+}
+
+void unmake_roots()
+{
+  for(int i = 0; i < N; i += 2) gc_unmake_root(gc_acquire_strong_ptr(&weak[i]));
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  gc_collect();
+  for(int i = 0; i < N; ++i)
+    require(!!gc_acquire_strong_ptr(&weak[i]) == !(i & 1) && "Only the allocations that are still roots should survive.");
+  require(debug_gc_num_roots_slots_populated() == N/2 + N/2 && "The remaining roots and their weak pointer reference blocks should be the only roots.");
+
+  CALL_INDIRECTLY(unmake_roots);
+  for(int i = 0; i < N; ++i) weak[i] = 0;
+  while(num_finalized < N/2) gc_collect();
+  gc_collect(); // Frees the finalized allocations, which unpins their weak pointer reference blocks,
+  gc_collect(); // and then frees the reference blocks.
+  require(num_finalized == N/2);
+  require(gc_num_ptrs() == 0);
+  require(debug_gc_num_roots_slots_populated() == 0);
+}
@@ -0,0 +1,55 @@
+// Tests the batch API: gc_malloc_batch(), gc_make_roots(), gc_unmake_roots() and gc_free_batch().
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+#include <stdlib.h>
+
+#define N 1000
+
+void **ptrs; // Allocated with malloc(), so not scanned by the GC.
+int num_finalized = 0;
+void my_finalizer(void *ptr) { ++num_finalized; }
+
+void alloc_roots()
+{
+  require(gc_malloc_batch(32, N, GC_FLAG_ROOT | GC_FLAG_LEAF | GC_FLAG_ZERO, 0, ptrs) == N);
+  for(int i = 0; i < N; ++i)
+  {
+    require(gc_is_ptr(ptrs[i]));
+    require(gc_is_root(ptrs[i]));
+    require(((char*)ptrs[i])[31] == 0 && "GC_FLAG_ZERO should zero-initialize allocations.");
+  }
+}
+
+void alloc_finalizable()
+{
+  require(gc_malloc_batch(1024, N, 0, my_finalizer, ptrs) == N);
+  for(int i = 0; i < N; ++i)
+  {
+    require(gc_get_finalizer(ptrs[i]) == my_finalizer);
+    require(!gc_is_root(ptrs[i]));
+  }
+}
+
+int main()
+{
+  ptrs = (void**)malloc(N * sizeof(void*));
+
+  CALL_INDIRECTLY(alloc_roots);
+  gc_collect();
+  require(gc_num_ptrs() == N && "Batch allocated roots should survive collection.");
+
+  gc_unmake_roots(ptrs, N);
+  gc_make_roots(ptrs, N/2);
+  gc_collect();
+  require(gc_num_ptrs() == N/2 && "Only the re-rooted half should survive collection.");
+
+  gc_free_batch(ptrs, N/2);
+  require(gc_num_ptrs() == 0);
+
+  CALL_INDIRECTLY(alloc_finalizable);
+  ptrs[0] = 0; // Null pointers are skipped by gc_free_batch().
+  gc_free_batch(ptrs, N);
+  require(gc_num_ptrs() == 1 && "gc_free_batch() should free all non-null pointers.");
+  require(num_finalized == 0 && "gc_free_batch() must not run finalizers.");
+}
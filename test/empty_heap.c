@@ -0,0 +1,17 @@
+// Tests that looking up pointers before the first managed allocation has been made, i.e. before the allocation table
+// exists, finds nothing.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+
+int main()
+{
+  void *ptr = malloc(64); // Memory that is not managed, but is in the heap.
+  require(!gc_is_ptr(ptr));
+  require(!gc_is_weak_ptr(ptr));
+  require(!gc_is_strong_ptr(ptr));
+  require(!gc_ptr_base(ptr));
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+  free(ptr);
+}
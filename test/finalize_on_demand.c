@@ -0,0 +1,54 @@
+// Tests that with -DEMGC_FINALIZE_ON_DEMAND, collections only queue finalizers, the queued objects stay alive until
+// gc_run_finalizers() has run their finalizers, and gc_remove_finalizer() cancels a queued finalizer.
+// flags: -sSPILL_POINTERS -DEMGC_FINALIZE_ON_DEMAND
+#include "test.h"
+
+#define N 10
+
+int finalized_count = 0;
+void count_finalizer(void *ptr) { ++finalized_count; }
+
+uintptr_t cancelled; // Disguised, so that it does not keep the allocation alive.
+
+void func()
+{
+  // Cleared, so that leftover data does not make one finalizable object point to another, which would defer its finalizer.
+  for(int i = 0; i < N; ++i) gc_register_finalizer(gc_calloc(64), count_finalizer);
+}
+
+void func2()
+{
+  void *ptr = gc_malloc(64);
+  cancelled = ~(uintptr_t)ptr;
+  gc_register_finalizer(ptr, count_finalizer);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+
+  gc_collect();
+  require(finalized_count == 0 && "Collections must not run finalizers in on-demand mode.");
+  require(gc_num_ptrs() == N && "Objects with queued finalizers must stay alive.");
+
+  require(gc_run_finalizers(3) == 3);
+  require(finalized_count == 3);
+
+  gc_collect(); // Frees the three finalized objects, and keeps the queued ones alive.
+  require(gc_num_ptrs() == N-3 && "Queued objects must survive collections until their finalizers have run.");
+
+  require(gc_run_finalizers(SIZE_MAX) == N-3);
+  require(finalized_count == N);
+  require(gc_run_finalizers(SIZE_MAX) == 0 && "The queue should be empty.");
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+
+  CALL_INDIRECTLY(func2);
+  gc_collect();
+  require(gc_num_ptrs() == 1);
+  gc_remove_finalizer((void*)~cancelled);
+  require(gc_run_finalizers(SIZE_MAX) == 0 && "A removed finalizer must not run.");
+  require(finalized_count == N);
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
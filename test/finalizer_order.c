@@ -0,0 +1,53 @@
+// Tests that finalizers run in topological order: when a chain of finalizable objects becomes unreachable, each
+// collection finalizes only the head of the chain, so no finalizer sees an object that has already been finalized.
+// flags: -sSPILL_POINTERS
+#include "test.h"
+
+#define N 5
+
+typedef struct node
+{
+  struct node *next;
+  int index;
+  int finalized;
+} node;
+
+int num_finalized = 0;
+void node_finalizer(void *ptr)
+{
+  node *n = (node*)ptr;
+  require(n->index == num_finalized && "Objects of the chain must be finalized in order from the head.");
+  require(!n->finalized && "An object must be finalized only once.");
+  n->finalized = 1;
+  if (n->next) require(!n->next->finalized && "The next object must not have been finalized before this one.");
+  ++num_finalized;
+}
+
+void func()
+{
+  node *head = 0;
+  for(int i = N-1; i >= 0; --i) // Build the chain from the tail, so that object i points to object i+1.
+  {
+    node *n = (node*)gc_calloc(sizeof(node)); // Cleared, so that leftover data does not link the objects otherwise.
+    n->next = head;
+    n->index = i;
+    gc_register_finalizer(n, node_finalizer);
+    head = n;
+  }
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  require(gc_num_ptrs() == N);
+
+  for(int i = 0; i < N; ++i)
+  {
+    gc_collect();
+    require(num_finalized == i+1 && "Each collection should finalize only the head of the chain.");
+    require(gc_num_ptrs() == N-i && "Finalized objects should be freed by the next collection.");
+  }
+  gc_collect();
+  require(num_finalized == N);
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,40 @@
+// Tests that finalizable objects that point to themselves, directly or through a cycle of finalizable objects, are
+// still finalized and freed: pointers from an object back to itself do not keep it from being finalized.
+// flags: -sSPILL_POINTERS
+#include "test.h"
+
+int num_finalized = 0;
+void count_finalizer(void *ptr) { ++num_finalized; }
+
+void func()
+{
+  void **self = (void**)gc_calloc(64); // Cleared, so that leftover data does not link the objects otherwise.
+  self[0] = self;
+  gc_register_finalizer(self, count_finalizer);
+}
+
+void func2()
+{
+  void **a = (void**)gc_calloc(64), **b = (void**)gc_calloc(64);
+  a[0] = b;
+  b[0] = a;
+  gc_register_finalizer(a, count_finalizer);
+  gc_register_finalizer(b, count_finalizer);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  gc_collect();
+  require(num_finalized == 1 && "An object that points to itself should be finalized.");
+  gc_collect();
+  require(gc_num_ptrs() == 0 && "The finalized self-referencing object should be freed.");
+
+  CALL_INDIRECTLY(func2);
+  gc_collect();
+  require(num_finalized == 2 && "One object of a cycle of finalizable objects should be finalized first.");
+  gc_collect();
+  require(num_finalized == 3 && "The other object of the cycle should be finalized once the first one is gone.");
+  gc_collect();
+  require(gc_num_ptrs() == 0 && "Both objects of the cycle should be freed.");
+}
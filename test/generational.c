@@ -0,0 +1,49 @@
+// Tests that a minor collection frees young garbage, keeps young objects that are only referenced from old objects
+// through the write barrier, and does not free old objects.
+// flags: -sSPILL_POINTERS -DEMGC_GENERATIONAL
+
+#include "test.h"
+
+void **old;
+
+void alloc_old()
+{
+  old = (void**)gc_calloc(64*sizeof(void*));
+}
+
+void alloc_young()
+{
+  for(int i = 0; i < 8; ++i)
+  {
+    gc_store_ptr(&old[i*8], gc_calloc(16)); // Spread the stores over several cards.
+    gc_calloc(16); // Garbage
+  }
+}
+
+void clear_old()
+{
+  for(int i = 0; i < 8; ++i) gc_store_ptr(&old[i*8], 0);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(alloc_old);
+  gc_collect(); // Promotes the object to the old generation.
+  require(gc_num_ptrs() == 1);
+
+  CALL_INDIRECTLY(alloc_young);
+  gc_collect_minor();
+  require(gc_num_ptrs() == 9 && "Young garbage should be freed, young objects stored through the barrier should survive.");
+
+  CALL_INDIRECTLY(clear_old);
+  gc_collect_minor();
+  require(gc_num_ptrs() == 9 && "A minor collection should not free objects that have been promoted to the old generation.");
+  gc_collect();
+  require(gc_num_ptrs() == 1 && "A major collection should free unreachable old objects.");
+
+  old = 0;
+  gc_collect_minor();
+  require(gc_num_ptrs() == 1);
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,67 @@
+// Tests that an incremental collection proceeds in several steps, frees garbage, and keeps allocations that the program
+// moves around or allocates while the collection is in progress.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+
+#define N 1000
+
+typedef struct node { struct node *next, *extra; } node;
+
+node *head;
+uintptr_t hidden_moved, hidden_new; // Addresses of nodes to check, hidden from marking.
+
+void build()
+{
+  for(int i = 0; i < N; ++i)
+  {
+    node *n = (node*)gc_calloc(sizeof(node));
+    n->next = head;
+    head = n;
+    gc_calloc(sizeof(node)); // Garbage
+  }
+}
+
+void mutate()
+{
+  // Move the last node of the list, which has not been marked yet, to be only referenced from the head node that has
+  // already been scanned. Then allocate a new node that is only referenced from the head node.
+  node *prev = head;
+  while(prev->next->next) prev = prev->next;
+  gc_store_ptr((void**)&head->extra, prev->next);
+  hidden_moved = ~(uintptr_t)prev->next;
+  gc_store_ptr((void**)&prev->next, 0);
+  gc_store_ptr((void**)&head->extra->extra, gc_calloc(sizeof(node)));
+  hidden_new = ~(uintptr_t)head->extra->extra;
+}
+
+void start_and_collect()
+{
+  require(gc_collect_step(0) == 0);
+  gc_collect(); // Completes the ongoing incremental collection, and performs a full one.
+}
+
+int main()
+{
+  CALL_INDIRECTLY(build);
+  require(gc_num_ptrs() == 2*N);
+
+  require(gc_collect_step(0) == 0 && "Marking a long list should not complete in a single step with a zero budget.");
+  CALL_INDIRECTLY(mutate);
+  int steps = 1;
+  while(!gc_collect_step(0)) ++steps;
+  require(steps > 1);
+  require(gc_num_ptrs() == N+1 && "Garbage should be freed, and nodes that were moved or allocated during the collection kept.");
+  require(gc_is_ptr((void*)~hidden_moved) && gc_is_ptr((void*)~hidden_new));
+
+  head = 0;
+  require(gc_collect_step(1e12) == 1 && "A collection should complete in a single step with a large budget.");
+  require(gc_num_ptrs() == 0);
+
+  CALL_INDIRECTLY(build);
+  CALL_INDIRECTLY(start_and_collect);
+  require(gc_num_ptrs() == N);
+  head = 0;
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,48 @@
+// Tests that in EMGC_INTERIOR_POINTERS mode, pointers to the interior of an allocation
+// keep the allocation alive, and that gc_ptr_base() resolves interior pointers of
+// many allocations, including ones that span several pages of the heap index.
+// flags: -sSPILL_POINTERS -DEMGC_INTERIOR_POINTERS
+
+#include "test.h"
+
+#define N 1000
+
+char *cursor, *large_cursor;
+char *ptrs[N];
+
+void func()
+{
+  char *small = (char*)gc_calloc(64);
+  char *large = (char*)gc_calloc(20000);
+  cursor = small + 13; // Unaligned interior pointer.
+  large_cursor = large + 15000; // Interior pointer several pages after the allocation start.
+  require(!gc_is_ptr(cursor) && "gc_is_ptr() only recognizes base addresses.");
+  require(gc_ptr_base(cursor) == small);
+  require(gc_ptr_base(large_cursor) == large);
+
+  for(int i = 0; i < N; ++i) ptrs[i] = (char*)gc_calloc(16 + (i % 7) * 1000);
+  for(int i = 0; i < N; ++i)
+  {
+    require(gc_ptr_base(ptrs[i]) == ptrs[i]);
+    require(gc_ptr_base(ptrs[i] + 15 + (i % 7) * 1000) == ptrs[i]);
+  }
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+
+  gc_collect();
+  require(gc_num_ptrs() == N+2 && "Interior pointers should keep allocations alive.");
+
+  for(int i = 0; i < N; ++i) ptrs[i] += 8; // Only interior pointers remain.
+  cursor = 0;
+  gc_collect();
+  require(gc_num_ptrs() == N+1 && "Allocation should be freed when no pointers to it remain.");
+  require(gc_ptr_base(large_cursor) != 0);
+
+  large_cursor = 0;
+  for(int i = 0; i < N; ++i) ptrs[i] = 0;
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,65 @@
+// Tests that allocations above the large object threshold are served from the large object space:
+// they are marked transitively, leaf large objects are not scanned, freed spans are coalesced, and
+// gc_realloc() grows large objects in place.
+// flags: -sSPILL_POINTERS -DEMGC_LARGE_OBJECT_SPACE -DEMGC_LARGE_OBJECT_THRESHOLD=65536
+#include "test.h"
+
+#define LARGE 100000 // Spans two 64KB pages.
+
+void **global, **leaf;
+
+void func()
+{
+  global = (void**)gc_calloc(LARGE);
+  global[LARGE/sizeof(void*) - 1] = gc_malloc(16); // A small object referenced only from the end of a large object.
+  global[0] = gc_calloc(LARGE); // A large object referenced only from another large object.
+  leaf = (void**)gc_calloc_leaf(LARGE);
+  leaf[100] = gc_malloc(16); // Leaf objects are not scanned, so this is garbage.
+  PIN(&global);
+  PIN(&leaf);
+  require(gc_is_ptr(global) && gc_is_ptr(global[0]) && gc_is_ptr(leaf));
+  require(!gc_is_ptr((char*)global + 8) && "Interior pointers to large objects must not be recognized as managed pointers.");
+  require(gc_ptr_base((char*)global + 70000) == global && "gc_ptr_base() must resolve interior pointers to large objects.");
+  for(int i = 0; i < 10; ++i) gc_malloc(LARGE); // Generate garbage.
+}
+
+void coalesce()
+{
+  char *a = (char*)gc_malloc(65536), *b = (char*)gc_malloc(65536), *c = (char*)gc_malloc(65536);
+  gc_free(a);
+  gc_free(b);
+  char *d = (char*)gc_malloc(2*65536);
+  require(d == a && "Two adjacent freed spans should have been coalesced to serve a larger allocation.");
+  gc_free(c);
+  gc_free(d);
+}
+
+void grow_in_place()
+{
+  char *a = (char*)gc_malloc(65536);
+  a[65535] = 42;
+  char *b = (char*)gc_realloc(a, 3*65536);
+  require(b == a && b[65535] == 42 && "A large object followed by free pages should grow in place.");
+  require(gc_ptr_base(b + 2*65536) == b);
+  gc_free(b);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+
+  gc_collect();
+  require(gc_num_ptrs() == 4 && "Large objects and objects referenced by them must survive, and garbage must be freed.");
+
+  global = leaf = 0;
+  PIN(&global);
+  PIN(&leaf);
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+
+  CALL_INDIRECTLY(coalesce);
+  require(gc_num_ptrs() == 0);
+
+  CALL_INDIRECTLY(grow_in_place);
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,35 @@
+// Tests that with -DEMGC_SCAN_MANAGED_GLOBALS_ONLY, only the globals declared with GC_MANAGED_GLOBAL
+// are scanned: they keep their allocations alive, while other globals do not.
+// flags: -sSPILL_POINTERS -DEMGC_SCAN_MANAGED_GLOBALS_ONLY
+#include "test.h"
+
+GC_MANAGED_GLOBAL char *managed;
+GC_MANAGED_GLOBAL char *managed_array[4];
+char *unmanaged;
+
+void func()
+{
+  managed = (char*)gc_malloc(1024);
+  for(int i = 0; i < 4; ++i) managed_array[i] = (char*)gc_malloc(16);
+  unmanaged = (char*)gc_malloc(1024);
+  PIN(&managed);
+  PIN(&managed_array);
+  PIN(&unmanaged);
+  require(gc_num_ptrs() == 6);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+
+  gc_collect();
+  require(gc_num_ptrs() == 5 && "Only the globals declared with GC_MANAGED_GLOBAL should have been scanned.");
+  require(gc_is_ptr(managed));
+  for(int i = 0; i < 4; ++i) require(gc_is_ptr(managed_array[i]));
+
+  managed = 0;
+  for(int i = 0; i < 4; ++i) managed_array[i] = 0;
+  PIN(&managed);
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
@@ -1,20 +1,25 @@
-// Tests that multiple objects with finalizers are all eventually finalized and freed.
-// The GC processes one finalizer per collection cycle, so N finalizeable objects require
-// N collections to run all finalizers, then one final collection to free the objects.
+// Tests that a collection queues the finalizers of all unreachable finalizable objects at once, keeps alive what they
+// point to until the finalizers have run, and frees all other garbage in the same collection.
 // flags: -sSPILL_POINTERS
 #include "test.h"
 
-#define N 5
+#define N 10000
 
 int finalized_count = 0;
-void count_finalizer(void *ptr) { ++finalized_count; }
+void count_finalizer(void *ptr)
+{
+  ++finalized_count;
+  require(gc_is_ptr(*(void**)ptr) && "Objects that a finalizable object points to must be alive when its finalizer runs.");
+}
 
 void func()
 {
   for(int i = 0; i < N; ++i)
   {
-    void *ptr = gc_malloc(64);
+    void **ptr = (void**)gc_calloc(64); // Cleared, so that leftover data does not keep garbage alive.
+    *ptr = gc_malloc_leaf(64);
     gc_register_finalizer(ptr, count_finalizer);
+    gc_malloc(64); // Garbage without a finalizer.
   }
 }
 
@@ -22,11 +27,12 @@ int main()
 {
   CALL_INDIRECTLY(func);
 
-  // N collection cycles to run all N finalizers (one per cycle).
-  for(int i = 0; i < N; ++i) gc_collect();
-  require(finalized_count == N && "All N finalizers must have run.");
+  gc_collect();
+  require(finalized_count == N && "All N finalizers must have run in a single collection.");
+  require(gc_num_ptrs() == 2*N && "Only the finalized objects and what they point to should survive the collection.");
 
-  // One final collection to free the now-finalized (no longer has PTR_FINALIZER_BIT) objects.
+  // The finalized objects no longer have finalizers, so they are freed like any other garbage.
   gc_collect();
+  require(finalized_count == N && "Finalizers must not run twice.");
   require(gc_num_ptrs() == 0 && "All finalized objects must be freed after the sweep cycle.");
 }
@@ -0,0 +1,47 @@
+// Tests that marking finds managed allocations interleaved with unmanaged malloc() memory, and that
+// the page prefilter and bounds of managed memory stay correct as they shrink and grow back.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+#include <stdlib.h>
+
+#define N 1000
+
+void *managed[N];
+void *unmanaged[N]; // Values that point to unmanaged memory must be ignored by marking.
+
+void func()
+{
+  for(int i = 0; i < N; ++i)
+  {
+    managed[i] = gc_calloc(16 + (i % 5) * 2000);
+    unmanaged[i] = malloc(16 + (i % 3) * 3000);
+  }
+}
+
+void func2()
+{
+  managed[0] = gc_calloc(64);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  gc_collect();
+  require(gc_num_ptrs() == N);
+
+  for(int i = 0; i < N; i += 2) managed[i] = 0;
+  gc_collect();
+  require(gc_num_ptrs() == N/2);
+
+  for(int i = 0; i < N; ++i) managed[i] = 0;
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+
+  // The bounds of managed memory are now empty, so they need to grow back for new allocations to be marked.
+  CALL_INDIRECTLY(func2);
+  gc_collect();
+  require(gc_num_ptrs() == 1 && "An allocation made after the managed memory bounds shrunk must be found by marking.");
+
+  for(int i = 0; i < N; ++i) free(unmanaged[i]);
+}
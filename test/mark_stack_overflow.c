@@ -0,0 +1,42 @@
+// Tests that marking runs in constant native stack space: a long linked list does not
+// recurse once per node, and a wide object graph that overflows the (deliberately tiny)
+// mark stack is still marked completely.
+// flags: -sSPILL_POINTERS -DEMGC_MARK_STACK_SIZE=16
+#include "test.h"
+
+#define LIST_LENGTH 1000000
+#define WIDTH 1000 // Number of children of the root array, far more than fit in the mark stack.
+
+void **list;
+void ***wide;
+
+void func()
+{
+  for(int i = 0; i < LIST_LENGTH; ++i)
+  {
+    void **node = (void**)gc_malloc(sizeof(void*));
+    *node = list;
+    list = node;
+  }
+
+  wide = (void***)gc_malloc(WIDTH*sizeof(void**));
+  for(int i = 0; i < WIDTH; ++i)
+  {
+    wide[i] = (void**)gc_malloc(2*sizeof(void*));
+    wide[i][0] = gc_calloc(sizeof(void*));
+    wide[i][1] = gc_calloc(sizeof(void*));
+  }
+  for(int i = 0; i < 100; ++i) gc_malloc(16); // Garbage.
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  gc_collect();
+  require(gc_num_ptrs() == LIST_LENGTH + 1 + 3*WIDTH && "All reachable objects should survive, and the garbage should be freed.");
+
+  list = 0;
+  wide = 0;
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
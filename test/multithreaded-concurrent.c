@@ -0,0 +1,73 @@
+// This test verifies that with concurrent marking, objects that a Wasm Worker keeps moving
+// around in the heap with gc_store_ptr() survive the collections that the main thread runs
+// while the worker keeps executing. The worker also allocates bursts of garbage, so that the
+// allocation table gets resized while the collections are tracing.
+// flags: -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS -g2 -DEMGC_CONCURRENT_MARKING
+// run: browser
+#include "test.h"
+#include <emscripten/wasm_worker.h>
+#include <emscripten/eventloop.h>
+
+#define N 256 // Number of slots that the worker shuffles nodes between.
+#define NUM_COLLECTIONS 50
+#define BURST 4096 // Number of garbage allocations in a burst, enough to grow the allocation table.
+
+typedef struct node
+{
+  uintptr_t tag; // The address of the node itself, to detect reuse of a freed node.
+  struct node *next;
+} node;
+
+emscripten_wasm_worker_t worker;
+
+_Atomic(int) num_collections;
+
+void collect_periodically(void *unused)
+{
+  gc_collect();
+  if (++num_collections < NUM_COLLECTIONS) emscripten_set_timeout(collect_periodically, 10, 0);
+}
+
+void *work(void *user1, void *user2)
+{
+  node **slots = (node**)gc_calloc(N*sizeof(node*));
+  for(uint32_t n = 0; num_collections < NUM_COLLECTIONS; ++n)
+  {
+    gc_participate_to_garbage_collection();
+
+    // Prepend a new node to a slot, and cut off the rest of its list.
+    uint32_t k = n % N;
+    node *head = (node*)gc_malloc(sizeof(node));
+    head->tag = (uintptr_t)head;
+    head->next = slots[k];
+    if (slots[k]) gc_store_ptr((void**)&slots[k]->next, 0);
+    gc_store_ptr((void**)&slots[k], head);
+
+    // Swap two slots, so that for a moment the only pointer to a node is in a local variable.
+    uint32_t i = (n * 7) % N, j = (n * 13) % N;
+    node *tmp = slots[i];
+    gc_store_ptr((void**)&slots[i], slots[j]);
+    gc_store_ptr((void**)&slots[j], tmp);
+
+    if (n % 64 == 0)
+      for(int b = 0; b < BURST; ++b) gc_malloc_leaf(16);
+  }
+
+  for(int i = 0; i < N; ++i)
+    for(node *n = slots[i]; n; n = n->next)
+      require(gc_is_ptr(n) && n->tag == (uintptr_t)n && "A node reachable from the slots should not have gotten garbage collected.");
+  exit(0);
+  return 0;
+}
+
+void worker_main()
+{
+  gc_enter_fence_cb(work, 0, 0);
+}
+
+int main()
+{
+  worker = emscripten_malloc_wasm_worker(64*1024);
+  emscripten_wasm_worker_post_function_v(worker, worker_main);
+  collect_periodically(0);
+}
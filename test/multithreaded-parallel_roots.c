@@ -0,0 +1,92 @@
+// This test verifies that the roots of a collection are marked completely when several Wasm Workers share their
+// scanning: a large static data section, custom root blocks, the roots table and the orphaned stacks of the
+// sleeping workers all span many root chunks.
+// flags: -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS -g2
+// run: browser
+#include "test.h"
+#include <emscripten/wasm_worker.h>
+#include <emscripten/eventloop.h>
+
+#define NT 4
+#define NG 65536 // Number of pointers in static data.
+#define NB 8 // Number of custom root blocks.
+#define NC 8192 // Number of pointers in each custom root block.
+#define NR 4096 // Number of roots.
+
+emscripten_wasm_worker_t worker[NT];
+
+_Atomic(int) num_workers_started, worker_quit;
+
+void *globals[NG];
+void **blocks[NB];
+void *roots[NR];
+uintptr_t worker_ptrs[NT]; // Offset by one byte, so that marking does not find the pointers here.
+
+void *work(void *user1, void *user2)
+{
+  void *volatile on_stack = gc_malloc(16); // Only referenced from the orphaned stack of this worker while it sleeps.
+  worker_ptrs[(int)(intptr_t)user1] = (uintptr_t)on_stack + 1;
+  ++num_workers_started;
+  while(!worker_quit) gc_sleep(1000000); // Orphans the stack while sleeping.
+  require(gc_is_ptr(on_stack));
+  return 0;
+}
+
+void worker_main(int i)
+{
+  gc_enter_fence_cb(work, (void*)(intptr_t)i, 0);
+}
+
+void *test(void *user1, void *user2)
+{
+  for(int i = 0; i < NG; ++i) globals[i] = gc_malloc(16);
+  for(int i = 0; i < NB; ++i)
+  {
+    blocks[i] = (void**)malloc(NC*sizeof(void*));
+    for(int j = 0; j < NC; ++j) blocks[i][j] = gc_malloc(16);
+    gc_add_custom_root_block(blocks[i], NC*sizeof(void*));
+  }
+  for(int i = 0; i < NR; ++i)
+  {
+    roots[i] = gc_malloc_root(16);
+    memset(roots[i], 0, 16); // Don't let leftover data keep garbage alive.
+  }
+  for(int i = 0; i < 1000; ++i) gc_malloc(16); // Garbage.
+  return 0;
+}
+
+void *verify(void *user1, void *user2)
+{
+  for(int i = 0; i < NG; ++i) require(gc_is_ptr(globals[i])); // Waits for the sweep to finish on the first call.
+  for(int i = 0; i < NB; ++i)
+    for(int j = 0; j < NC; ++j) require(gc_is_ptr(blocks[i][j]));
+  for(int i = 0; i < NR; ++i) require(gc_is_ptr(roots[i]));
+  for(int i = 0; i < NT; ++i) require(gc_is_ptr((void*)(worker_ptrs[i] - 1)));
+  require(gc_num_ptrs() == NG + NB*NC + NR + NT && "All reachable objects should survive, and all garbage should be freed.");
+  return 0;
+}
+
+void start_test()
+{
+  gc_enter_fence_cb(test, 0, 0);
+  gc_collect();
+  gc_enter_fence_cb(verify, 0, 0);
+  worker_quit = 1;
+  exit(0);
+}
+
+void wait_for_workers(void *unused)
+{
+  if (num_workers_started < NT) emscripten_set_timeout(wait_for_workers, 10, 0);
+  else start_test();
+}
+
+int main()
+{
+  for(int i = 0; i < NT; ++i)
+  {
+    worker[i] = emscripten_malloc_wasm_worker(64*1024);
+    emscripten_wasm_worker_post_function_vi(worker[i], worker_main, i);
+  }
+  wait_for_workers(0);
+}
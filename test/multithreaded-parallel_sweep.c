@@ -0,0 +1,51 @@
+// This test verifies that when several sweep helper threads sweep the allocation table in parallel, every unreachable
+// object is freed exactly once, and no reachable object is freed.
+// flags: -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS -DEMGC_NUM_SWEEP_WORKERS=4 -g2
+// run: browser
+#include "test.h"
+#include <emscripten/wasm_worker.h>
+#include <emscripten/eventloop.h>
+
+#define N 65536 // Number of live objects, enough to span several sweep partitions of the table.
+#define G 3 // Number of garbage objects allocated in between each live object.
+
+uint32_t **root; // A global, so that collections scan it.
+
+void *test(void *user1, void *user2)
+{
+  root = (uint32_t**)gc_malloc(N*sizeof(uint32_t*));
+  for(int i = 0; i < N; ++i)
+  {
+    for(int j = 0; j < G; ++j) gc_malloc_leaf(16); // Garbage, interleaved with the live objects in the table.
+    root[i] = (uint32_t*)gc_malloc_leaf(16);
+    *root[i] = i;
+  }
+  require(gc_num_ptrs() == 1 + N + N*G);
+  return 0;
+}
+
+void *verify(void *user1, void *user2)
+{
+  for(int i = 0; i < N; ++i)
+  {
+    require(gc_is_ptr(root[i])); // Waits for the sweep to finish on the first call.
+    require(*root[i] == (uint32_t)i);
+  }
+  require(gc_num_ptrs() == 1 + N && "All garbage should be freed exactly once, and all reachable objects should survive.");
+  return 0;
+}
+
+void start_test(void *unused)
+{
+  gc_enter_fence_cb(test, 0, 0);
+  gc_collect();
+  gc_enter_fence_cb(verify, 0, 0);
+  gc_collect(); // Nothing is garbage now, so a second sweep must not free anything.
+  gc_enter_fence_cb(verify, 0, 0);
+  exit(0);
+}
+
+int main()
+{
+  emscripten_set_timeout(start_test, 100, 0); // Give the sweep helper threads time to start up.
+}
@@ -0,0 +1,58 @@
+// This test verifies that allocations that a Wasm Worker has buffered in its thread-local
+// allocation buffer (and not yet published to the allocation table) survive a gc_collect()
+// from the main thread, along with everything they reference.
+// flags: -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS -g2
+// run: browser
+#include "test.h"
+#include <emscripten/wasm_worker.h>
+
+#define N 1000 // Allocate more than fit in one thread-local allocation buffer, so some get published, and some not.
+
+emscripten_wasm_worker_t worker;
+
+_Atomic(int) worker_quit;
+
+void worker_has_started()
+{
+  gc_collect();
+  worker_quit = 1;
+}
+
+void *work(void *user1, void *user2)
+{
+  void *garbage = 0;
+  for(int i = 0; i < N; ++i) garbage = gc_malloc(16); // Garbage, that should be freed up.
+  gc_free(garbage); // Looking up the allocation table publishes all garbage that this thread has buffered.
+
+  void **head = 0;
+  for(int i = 0; i < N; ++i)
+  {
+    void **node = (void**)gc_malloc(sizeof(void*));
+    *node = head;
+    head = node;
+  }
+
+  emscripten_wasm_worker_post_function_v(0, worker_has_started);
+
+  while(!worker_quit)
+    emscripten_wasm_worker_sleep(10000);
+
+  int n = 0;
+  for(void **node = head; node; node = (void**)*node, ++n)
+    require(gc_is_ptr(node) && "Linked list node on a Wasm Worker should not have gotten garbage collected.");
+  require(n == N);
+  require(gc_num_ptrs() == N && "Only the linked list nodes should remain alive.");
+  exit(0);
+  return 0;
+}
+
+void worker_main()
+{
+  gc_enter_fence_cb(work, 0, 0);
+}
+
+int main()
+{
+  worker = emscripten_malloc_wasm_worker(64*1024);
+  emscripten_wasm_worker_post_function_v(worker, worker_main);
+}
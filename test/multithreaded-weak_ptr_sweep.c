@@ -0,0 +1,63 @@
+// This test verifies that weak pointers to allocations that a Wasm Worker still held in its thread-local allocation
+// buffer are cleared when the sweep frees the allocations in batches, and are kept for the allocations that survive.
+// Built with NDEBUG, since the assertions of gc_get_weak_ptr() would publish the buffer before the weak pointer is made.
+// flags: -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS -g2 -DNDEBUG
+// run: browser
+#include "test.h"
+#include <emscripten/wasm_worker.h>
+
+#define N 1000 // Many more than fit in one sweep batch, so the dead allocations get freed in several batches.
+
+emscripten_wasm_worker_t worker;
+
+_Atomic(int) worker_quit;
+
+void *live[N]; // Every other allocation is kept alive through this global.
+void *weak[N];
+
+void worker_has_started()
+{
+  gc_collect();
+  worker_quit = 1;
+}
+
+__attribute__((noinline)) void allocate()
+{
+  for(int i = 0; i < N; ++i)
+  {
+    void *ptr = gc_malloc(16); // Buffered in the thread-local allocation buffer of this thread.
+    weak[i] = gc_get_weak_ptr(ptr);
+    require(weak[i]);
+    if (i % 2 == 0) live[i] = ptr;
+  }
+}
+
+void *work(void *user1, void *user2)
+{
+  CALL_INDIRECTLY(allocate);
+
+  emscripten_wasm_worker_post_function_v(0, worker_has_started);
+
+  while(!worker_quit)
+    emscripten_wasm_worker_sleep(10000);
+
+  for(int i = 0; i < N; ++i)
+  {
+    void *strong = gc_acquire_strong_ptr(&weak[i]);
+    if (i % 2 == 0) require(strong == live[i] && "Weak pointer to a live allocation should still refer to it.");
+    else require(strong == 0 && "Weak pointer to a freed allocation should have been cleared.");
+  }
+  exit(0);
+  return 0;
+}
+
+void worker_main()
+{
+  gc_enter_fence_cb(work, 0, 0);
+}
+
+int main()
+{
+  worker = emscripten_malloc_wasm_worker(64*1024);
+  emscripten_wasm_worker_post_function_v(worker, worker_main);
+}
@@ -0,0 +1,75 @@
+// This test verifies that a large object graph, whose marking overflows the mark deques of the
+// marking threads, is marked completely when several Wasm Workers participate to gc_collect().
+// flags: -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS -g2
+// run: browser
+#include "test.h"
+#include <emscripten/wasm_worker.h>
+#include <emscripten/eventloop.h>
+
+#define NT 4
+#define N 16384 // Number of children of the root array, far more than fit in a mark deque.
+#define M 4 // Number of grandchildren of each child.
+
+emscripten_wasm_worker_t worker[NT];
+
+_Atomic(int) num_workers_started, worker_quit;
+
+void ***root; // A global, so that collections scan it.
+
+void *work(void *user1, void *user2)
+{
+  ++num_workers_started;
+  while(!worker_quit) gc_sleep(1000000); // Participates to the collection while sleeping.
+  return 0;
+}
+
+void worker_main()
+{
+  gc_enter_fence_cb(work, 0, 0);
+}
+
+void *test(void *user1, void *user2)
+{
+  root = (void***)gc_malloc(N*sizeof(void**));
+  for(int i = 0; i < N; ++i)
+  {
+    root[i] = (void**)gc_malloc(M*sizeof(void*));
+    for(int j = 0; j < M; ++j) root[i][j] = gc_malloc(16);
+  }
+  for(int i = 0; i < 1000; ++i) gc_malloc(16); // Garbage.
+  return 0;
+}
+
+void *verify(void *user1, void *user2)
+{
+  for(int i = 0; i < N; ++i)
+    for(int j = 0; j < M; ++j)
+      require(gc_is_ptr(root[i][j])); // Waits for the sweep to finish on the first call.
+  require(gc_num_ptrs() == 1 + N + N*M && "All reachable objects should survive, and all garbage should be freed.");
+  return 0;
+}
+
+void start_test()
+{
+  gc_enter_fence_cb(test, 0, 0);
+  gc_collect();
+  gc_enter_fence_cb(verify, 0, 0);
+  worker_quit = 1;
+  exit(0);
+}
+
+void wait_for_workers(void *unused)
+{
+  if (num_workers_started < NT) emscripten_set_timeout(wait_for_workers, 10, 0);
+  else start_test();
+}
+
+int main()
+{
+  for(int i = 0; i < NT; ++i)
+  {
+    worker[i] = emscripten_malloc_wasm_worker(64*1024);
+    emscripten_wasm_worker_post_function_v(worker[i], worker_main);
+  }
+  wait_for_workers(0);
+}
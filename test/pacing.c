@@ -0,0 +1,47 @@
+// Tests that collection pacing collects garbage automatically as the program allocates,
+// without any explicit gc_collect() calls, and that gc_collection_debt() is reset by a collection.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+
+#define N 20000
+
+void **list; // A linked list of live objects that must survive the automatic collections.
+int max_ptrs = 0;
+
+void func()
+{
+  for(int i = 0; i < N; ++i)
+  {
+    gc_calloc(1024); // Garbage.
+    if (i % 100 == 0)
+    {
+      void **node = (void**)gc_calloc(64);
+      node[0] = list;
+      list = node;
+    }
+    if (gc_num_ptrs() > max_ptrs) max_ptrs = gc_num_ptrs();
+  }
+}
+
+int main()
+{
+  require(gc_collection_debt() < 0);
+  gc_set_pacing(GC_PACING_SYNC, 1.0);
+  CALL_INDIRECTLY(func);
+
+  // The pacing budget is 1MB, so about 1000 of the 1KB garbage allocations may accumulate between collections.
+  require(max_ptrs < N/4 && "Pacing should have collected garbage while allocating.");
+  int n = 0;
+  for(void **node = list; node; node = (void**)node[0]) ++n;
+  require(n == N/100 && "Live objects must survive the paced collections.");
+
+  gc_collect();
+  require(gc_collection_debt() < 0 && "A collection should pay off the collection debt.");
+
+  gc_set_pacing(GC_PACING_OFF, 1.0);
+  list = 0;
+  CALL_INDIRECTLY(func);
+  require(gc_collection_debt() > 0);
+  require(gc_num_ptrs() >= N && "No collections should happen with pacing disabled.");
+}
@@ -1,20 +1,103 @@
-// Tests how fast the marking process can run on a large allocation array.
-// flags: -sALLOW_MEMORY_GROWTH -sMAXIMUM_MEMORY=4GB -sSPILL_POINTERS
+// Tests how fast the marking process can run on a large allocation array, with an increasing number of
+// Wasm Workers participating to the collection. The array is scanned in chunks by all marking threads.
+// Finally the array is made pointer-dense, to measure the cost of the allocation table lookups of marking, both with
+// the staged batch lookups of the SIMD marking kernel and with the candidates looked up one at a time.
+// flags: -sALLOW_MEMORY_GROWTH -sMAXIMUM_MEMORY=4GB -sSPILL_POINTERS -sCOOPERATIVE_GC -sWASM_WORKERS
+// run: browser
 #include "test.h"
 #include <emscripten/html5.h>
+#include <emscripten/wasm_worker.h>
+#include <emscripten/eventloop.h>
 
-int main()
+#define NT 8 // Maximum number of marking threads, including the main thread.
+
+emscripten_wasm_worker_t worker[NT];
+
+_Atomic(int) num_workers_started, worker_quit;
+
+uint32_t size = 3800ull*1024*1024;
+uint32_t *large; // A global, so that collections scan it.
+int num_threads = 1;
+int pointer_dense = 0;
+int serial_lookups = 0;
+
+#define NUM_OBJECTS (1024*1024) // Number of small allocations that the pointer-dense array points to.
+
+void *work(void *user1, void *user2)
 {
-  srand(emscripten_random()*(2048u*1024*1024));
-  uint32_t size = 3800ull*1024*1024;
-  uint32_t *large = gc_malloc(size);
+  ++num_workers_started;
+  while(!worker_quit) gc_sleep(1000000); // Participates to the collection while sleeping.
+  return 0;
+}
+
+void worker_main()
+{
+  gc_enter_fence_cb(work, 0, 0);
+}
+
+void *alloc(void *user1, void *user2)
+{
+  large = gc_malloc(size);
   require(large != 0);
   for(uint32_t i = 0; i < 900ull*1024*1024; ++i)
     if ((rand() % 10) < 3)
       large[i] = rand();
-  PIN(&large);
+  return 0;
+}
+
+void *make_pointer_dense(void *user1, void *user2)
+{
+  void **objects = (void**)large;
+  for(uint32_t i = 0; i < NUM_OBJECTS; ++i)
+    objects[i] = gc_malloc_leaf(16);
+  for(uint32_t i = NUM_OBJECTS; i < 900ull*1024*1024; ++i)
+    large[i] = ((rand() % 10) < 3) ? (uint32_t)(uintptr_t)objects[rand() % NUM_OBJECTS] : 0;
+  return 0;
+}
+
+void measure(void *unused)
+{
+  if (num_workers_started < num_threads-1) // Wait for the started workers to enter the fence.
+  {
+    emscripten_set_timeout(measure, 10, 0);
+    return;
+  }
   double t0 = emscripten_performance_now();
   gc_collect();
   double t1 = emscripten_performance_now();
-  printf("gc_collect() took %f msecs. i.e. marked %f MB/second.\n", t1-t0, size * 1000.0 / ((t1-t0)*1024*1024));
+  printf("%d threads%s: gc_collect() took %f msecs. i.e. marked %f MB/second.\n", num_threads, pointer_dense ? (serial_lookups ? " (pointer-dense, serial lookups)" : " (pointer-dense, batched lookups)") : "", t1-t0, size * 1000.0 / ((t1-t0)*1024*1024));
+
+  if (num_threads == NT)
+  {
+    if (!pointer_dense)
+    {
+      pointer_dense = 1;
+      gc_enter_fence_cb(make_pointer_dense, 0, 0);
+      measure(0);
+      return;
+    }
+    if (!serial_lookups)
+    {
+      serial_lookups = 1;
+      debug_gc_set_batched_mark_lookups(0);
+      measure(0);
+      return;
+    }
+    worker_quit = 1;
+    exit(0);
+  }
+  for(int i = num_threads-1; i < 2*num_threads-1; ++i) // Double the number of marking threads.
+  {
+    worker[i] = emscripten_malloc_wasm_worker(64*1024);
+    emscripten_wasm_worker_post_function_v(worker[i], worker_main);
+  }
+  num_threads *= 2;
+  measure(0);
+}
+
+int main()
+{
+  srand(emscripten_random()*(2048u*1024*1024));
+  gc_enter_fence_cb(alloc, 0, 0);
+  measure(0);
 }
@@ -0,0 +1,68 @@
+// Tests that gc_realloc() preserves the contents of the allocation, and that a moved allocation
+// keeps its root, leaf, finalizer and weak pointer status.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+#include <string.h>
+
+int num_finalized = 0;
+void my_finalizer(void *ptr) { ++num_finalized; }
+
+char *str;
+void *weak;
+
+void grow_string()
+{
+  str = (char*)gc_malloc(1);
+  str[0] = '\0';
+  for(int i = 0; i < 1000; ++i)
+  {
+    str = (char*)gc_realloc(str, strlen(str) + 4);
+    strcat(str, "foo");
+  }
+}
+
+void move_with_metadata()
+{
+  char *root = (char*)gc_malloc_root(16);
+  strcpy(root, "root");
+  gc_register_finalizer(root, my_finalizer);
+  weak = gc_get_weak_ptr(root);
+
+  char *leaf = (char*)gc_calloc_leaf(16);
+  *(void**)leaf = gc_malloc(16); // Leaf objects are not scanned, so this is garbage.
+  PIN(&leaf);
+
+  root = (char*)gc_realloc(root, 100000);
+  leaf = (char*)gc_realloc(leaf, 100000);
+  require(!strcmp(root, "root") && "Contents must be preserved.");
+  require(gc_is_root(root));
+  require(gc_get_finalizer(root) == my_finalizer);
+  require(gc_acquire_strong_ptr(&weak) == root && "Weak pointer must refer to the new address.");
+  PIN(&leaf);
+}
+
+void unmake_root() { gc_unmake_root(gc_acquire_strong_ptr(&weak)); }
+
+int main()
+{
+  CALL_INDIRECTLY(grow_string);
+  gc_collect();
+  require(strlen(str) == 3000);
+  require(gc_num_ptrs() == 1 && "Reallocating should not leave the old allocations behind as garbage.");
+  str = 0;
+
+  CALL_INDIRECTLY(move_with_metadata);
+  gc_collect();
+  require(gc_num_ptrs() == 2 && "The moved root and its weak pointer should survive, the garbage referenced by the leaf should be freed.");
+  require(num_finalized == 0);
+
+  // Once the moved object is no longer a root, it is finalized and freed.
+  CALL_INDIRECTLY(unmake_root);
+  weak = 0;
+  gc_collect();
+  gc_collect();
+  gc_collect();
+  require(num_finalized == 1);
+  require(gc_num_ptrs() == 0);
+}
@@ -0,0 +1,34 @@
+// Tests that marking scans only the requested size of an allocation: a stale pointer that is left in the tail of an
+// allocation after it has been shrunk in place must not keep the pointed-to allocation alive. This also holds when the
+// requested size is not a multiple of 16 bytes, so that the tail of the allocation is scanned with a partial vector.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+
+void **obj, **obj2;
+
+void func()
+{
+  obj = (void**)gc_calloc(1024);
+  obj[64] = gc_calloc(16); // Placed past the first 256 bytes.
+  obj[0] = gc_calloc(16);
+  obj = (void**)gc_realloc(obj, 256);
+
+  obj2 = (void**)gc_calloc(256);
+  *(void**)((char*)obj2 + 144) = gc_calloc(16); // Inside the requested 148 bytes.
+  *(void**)((char*)obj2 + 152) = gc_calloc(16); // Past the requested 148 bytes, in the same 16 byte vector as the above.
+  obj2 = (void**)gc_realloc(obj2, 148);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  gc_collect();
+  require(gc_num_ptrs() == 4 && "Only the shrunk allocations and the allocations referenced from their requested sizes should survive.");
+  require(gc_ptr_base((char*)obj + 255) == obj);
+  require(gc_ptr_base((char*)obj + 256) == 0 && "gc_ptr_base() should only resolve addresses inside the requested size.");
+
+  obj = obj2 = 0;
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}
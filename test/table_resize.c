@@ -0,0 +1,56 @@
+// Tests that allocations stay findable while the allocation table is being resized incrementally, and that
+// gc_reserve() pre-sizes the table.
+// flags: -sSPILL_POINTERS
+
+#include "test.h"
+
+#define N 20000
+
+void *ptrs[N];
+
+void func()
+{
+  for(int i = 0; i < N; ++i)
+  {
+    ptrs[i] = gc_calloc(16);
+    // Look up and free older allocations while the table grows, so that some are found in the old table before
+    // they have been migrated.
+    if (i % 3 == 2)
+    {
+      int j = i / 2;
+      require(gc_is_ptr(ptrs[j]));
+      gc_free(ptrs[j]);
+      require(!gc_is_ptr(ptrs[j]) && "A freed allocation must not be found in the old table.");
+      ptrs[j] = 0;
+    }
+  }
+  for(int i = 0; i < N; ++i) require(!ptrs[i] || gc_is_ptr(ptrs[i]));
+}
+
+void func2()
+{
+  gc_reserve(2*N);
+  uint32_t reserved_size = debug_gc_table_size();
+  require(reserved_size >= 4*N && "gc_reserve() should size the table to fit the reserved allocations at half load.");
+  for(int i = 0; i < N; ++i)
+    if (!ptrs[i]) ptrs[i] = gc_calloc(16);
+  require(debug_gc_table_size() == reserved_size && "The table should not have been resized during the reserved burst.");
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  uint32_t num = gc_num_ptrs();
+  gc_collect();
+  require(gc_num_ptrs() == num);
+
+  CALL_INDIRECTLY(func2);
+  gc_collect();
+  require(gc_num_ptrs() == N);
+
+  for(int i = 0; i < N; ++i) ptrs[i] = 0;
+  gc_reserve(0);
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+  require(debug_gc_table_size() == 128 && "The table should shrink back to its minimum size once the reservation is lifted.");
+}
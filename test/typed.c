@@ -0,0 +1,74 @@
+// Tests that typed allocations are only scanned at the pointer slots that their type declares:
+// a pointer in a data word does not keep its target alive, while pointers in declared slots do,
+// including in repeating layouts (arrays of structs) and in types marked with a trace callback.
+// flags: -sSPILL_POINTERS
+#include "test.h"
+
+typedef struct node
+{
+  void *data[3]; // Not scanned.
+  void *next;
+} node;
+
+typedef struct pair
+{
+  void *ptr;
+  void *data;
+} pair;
+
+pair *pairs;
+node *list;
+void **traced;
+
+void trace_first(void *ptr, size_t bytes, gc_visit_func visit)
+{
+  visit(((void**)ptr)[0]);
+}
+
+void func()
+{
+  uint32_t node_layout = 1u << 3; // Only word 3 (next) holds a pointer.
+  gc_type node_type = gc_register_type(&node_layout, 4, 0);
+  uint32_t pair_layout = 1u << 0;
+  gc_type pair_type = gc_register_type(&pair_layout, 2, /*repeat=*/1);
+  gc_type traced_type = gc_register_trace(trace_first);
+  require(node_type && pair_type && traced_type);
+
+  list = (node*)gc_calloc_typed(sizeof(node), node_type);
+  list->next = gc_calloc_typed(sizeof(node), node_type); // Kept alive.
+  list->data[0] = gc_malloc(16); // Not kept alive.
+
+  pairs = (pair*)gc_calloc_typed(4*sizeof(pair), pair_type);
+  for(int i = 0; i < 4; ++i)
+  {
+    pairs[i].ptr = gc_malloc(16); // Kept alive.
+    pairs[i].data = gc_malloc(16); // Not kept alive.
+  }
+
+  traced = (void**)gc_calloc_typed(2*sizeof(void*), traced_type);
+  traced[0] = gc_malloc(16); // Kept alive.
+  traced[1] = gc_malloc(16); // Not kept alive.
+  require(gc_num_ptrs() == 15);
+}
+
+int main()
+{
+  CALL_INDIRECTLY(func);
+  gc_collect();
+  require(gc_num_ptrs() == 9 && "Only the pointers in declared slots should have kept their targets alive.");
+  require(gc_is_ptr(list->next));
+  for(int i = 0; i < 4; ++i) require(gc_is_ptr(pairs[i].ptr));
+  require(gc_is_ptr(traced[0]));
+
+  // Typed allocations keep their type when they are moved by gc_realloc().
+  pairs = (pair*)gc_realloc(pairs, 1024*sizeof(pair));
+  gc_collect();
+  require(gc_num_ptrs() == 9);
+  for(int i = 0; i < 4; ++i) require(gc_is_ptr(pairs[i].ptr));
+
+  list = 0;
+  pairs = 0;
+  traced = 0;
+  gc_collect();
+  require(gc_num_ptrs() == 0);
+}